@@ -0,0 +1,111 @@
+// 大量の接続が一度に来たとき、全部を受け付けるまでの時間を accept スレッド数・バックエンドごとに測る
+// 接続する側は別プロセス（fork）で、ノンブロッキングの connect を一気に発行する
+#include <sys/wait.h>
+
+#include <atomic>
+#include <cstdio>
+#include <thread>
+
+#include "BenchClient.hpp"
+#include "StardustLib/TCPServer.hpp"
+
+using namespace StardustLib;
+
+namespace
+{
+    constexpr int Count = 10000;
+
+    bool raiseFileLimit()
+    {
+        rlimit limit;
+        if(getrlimit(RLIMIT_NOFILE, &limit) != 0) return false;
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        return limit.rlim_cur >= (rlim_t)Count + 256;
+    }
+
+    bool run(uint16_t port, unsigned acceptThreads, bool useIoUring)
+    {
+        TCPServer server(port);
+        TCPServer::ConnectionOptions options;
+        options.acceptThreads = acceptThreads;
+        options.listenBacklog = 4096;
+        options.useIoUring = useIoUring;
+        server.setConnectionOptions(options);
+
+        std::atomic<int> accepted{0};
+        server.setClientIPAddressCallback([&accepted](uint32_t, uint32_t) { accepted.fetch_add(1, std::memory_order_relaxed); });
+        if(!server.start()) return false;
+
+        int sync[2];
+        if(pipe(sync) != 0) return false;
+
+        // fork 後の子ではメモリを確保しない
+        std::vector<int> fds;
+        fds.reserve(Count);
+
+        double cpuBegin = Bench::cpuSeconds();
+        Bench::Stopwatch watch;
+        pid_t pid = fork();
+        if(pid == 0)
+        {
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(port);
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            for(int i = 0; i < Count; i++)
+            {
+                int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+                if(fd < 0) break;
+                connect(fd, (sockaddr*)&addr, sizeof(addr));
+                fds.push_back(fd);
+            }
+
+            // 数え終わるまで接続を持っておく
+            char c;
+            if(read(sync[0], &c, 1) < 0) _exit(1);
+            _exit(0);
+        }
+        if(pid < 0) return false;
+
+        while(accepted.load(std::memory_order_relaxed) < Count && watch.seconds() < 30.0) usleep(1000);
+        double seconds = watch.seconds();
+        double cpu = Bench::cpuSeconds() - cpuBegin;
+
+        std::printf("acceptThreads %u  %-5s  accepted %5d in %7.1f ms  %6.0f conn/s  server CPU %5.1f us/conn\n",
+            acceptThreads, server.isUsingIoUring() ? "uring" : "poll", accepted.load(), seconds * 1e3,
+            accepted.load() / seconds, cpu * 1e6 / std::max(accepted.load(), 1));
+
+        if(write(sync[1], "x", 1) < 0) return false;
+        waitpid(pid, nullptr, 0);
+        close(sync[0]);
+        close(sync[1]);
+        server.stop();
+        return true;
+    }
+}
+
+int main()
+{
+    if(!raiseFileLimit())
+    {
+        std::printf("RLIMIT_NOFILE is too low for %d connections\n", Count);
+        return 1;
+    }
+
+    std::printf("%d connections, hardware_concurrency %u\n", Count, std::thread::hardware_concurrency());
+
+    uint16_t port = 20231;
+    for(bool useIoUring : { false, true })
+    {
+        for(unsigned acceptThreads : { 1u, 2u, 4u })
+        {
+            if(!run(port++, acceptThreads, useIoUring))
+            {
+                std::printf("failed\n");
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <vector>
+
+#include "StardustLib/Frame.hpp"
+
+namespace Bench
+{
+    // ベンチマークのクライアント側（ブロッキングソケット）。サーバーと同じプロセスで動かす
+
+    inline int connectTcp(uint16_t port, bool noDelay = true)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if(fd < 0) return -1;
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if(connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0)
+        {
+            close(fd);
+            return -1;
+        }
+
+        int opt = noDelay ? 1 : 0;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        return fd;
+    }
+
+    inline int connectUnix(const char* path)
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd < 0) return -1;
+
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        std::strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+        if(connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0)
+        {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    inline bool writeAll(int fd, const void* data, size_t size)
+    {
+        auto* p = static_cast<const uint8_t*>(data);
+        while(size > 0)
+        {
+            ssize_t n = ::send(fd, p, size, MSG_NOSIGNAL);
+            if(n <= 0) return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    inline bool readAll(int fd, void* data, size_t size)
+    {
+        auto* p = static_cast<uint8_t*>(data);
+        while(size > 0)
+        {
+            ssize_t n = ::recv(fd, p, size, 0);
+            if(n <= 0) return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    inline void putU32(uint8_t* dst, uint32_t value)
+    {
+        value = htonl(value);
+        std::memcpy(dst, &value, sizeof(value));
+    }
+
+    inline uint32_t getU32(const uint8_t* src)
+    {
+        uint32_t value;
+        std::memcpy(&value, src, sizeof(value));
+        return ntohl(value);
+    }
+
+    // [u32 BE length][u8 flags][payload]
+    inline void appendFrame(std::vector<uint8_t>& out, uint8_t flags, std::span<const uint8_t> payload)
+    {
+        size_t offset = out.size();
+        out.resize(offset + StardustLib::Frame::HeaderSize);
+        putU32(out.data() + offset, (uint32_t)payload.size() + 1);
+        out[offset + StardustLib::Frame::LengthSize] = flags;
+        out.insert(out.end(), payload.begin(), payload.end());
+    }
+
+    inline bool readFrame(int fd, uint8_t& flags, std::vector<uint8_t>& payload)
+    {
+        uint8_t header[StardustLib::Frame::HeaderSize];
+        if(!readAll(fd, header, sizeof(header))) return false;
+
+        uint32_t length = getU32(header);
+        if(length == 0) return false;
+        flags = header[StardustLib::Frame::LengthSize];
+        payload.resize(length - 1);
+        return readAll(fd, payload.data(), payload.size());
+    }
+
+    // プロセス全体（サーバーのスレッドを含む）の CPU 時間
+    inline double cpuSeconds()
+    {
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    }
+
+    class Stopwatch
+    {
+    private:
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+    public:
+        double seconds() const { return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count(); }
+    };
+
+    // values は並べ替えられる
+    inline double percentile(std::vector<double>& values, double p)
+    {
+        if(values.empty()) return 0.0;
+        std::sort(values.begin(), values.end());
+        return values[std::min(values.size() - 1, (size_t)(p * values.size()))];
+    }
+}
@@ -0,0 +1,226 @@
+// 圧縮の効果（比率）とコスト（1MB あたりの CPU 時間）を両方向で測る
+//   下り: サーバーがスナップショットを N 個送り、クライアントが展開して確かめる
+//   上り: クライアントが圧縮済みのフレームを N 個送り、サーバーが展開する
+#include <atomic>
+#include <cstdio>
+#include <random>
+#include <thread>
+
+#include "BenchClient.hpp"
+#include "StardustLib/Compression.hpp"
+#include "StardustLib/MessageServer.hpp"
+
+using namespace StardustLib;
+
+namespace
+{
+    constexpr uint32_t UploadId = 1;
+    constexpr uint32_t DownloadId = 2;
+    constexpr uint32_t Count = 20000;
+
+    std::vector<std::vector<uint8_t>> gMessages;
+    std::atomic<uint32_t> gUploaded{0};
+
+    struct Upload : MessageView
+    {
+        using MessageView::MessageView;
+        static constexpr size_t Size = 0;
+
+        void process() override { gUploaded.fetch_add(1, std::memory_order_relaxed); }
+    };
+
+    struct Download : MessageView
+    {
+        using MessageView::MessageView;
+        static constexpr size_t Size = 4;
+
+        void process() override
+        {
+            uint32_t count = field<uint32_t>(0);
+            for(uint32_t i = 0; i < count; i++)
+            {
+                TCPServer::Packet packet;
+                packet.clientId = getClientId();
+                packet.data = gMessages[i % gMessages.size()];
+                getServer()->send(std::move(packet));
+            }
+        }
+    };
+
+    void writeU32(std::vector<uint8_t>& out, uint32_t value)
+    {
+        uint8_t bytes[4];
+        Bench::putU32(bytes, value);
+        out.insert(out.end(), bytes, bytes + 4);
+    }
+
+    void writeF32(std::vector<uint8_t>& out, float value)
+    {
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        writeU32(out, bits);
+    }
+
+    // ゲームの状態スナップショット。128 体分のうち毎回数体だけが少し動く
+    std::vector<std::vector<uint8_t>> makeSnapshots(size_t count)
+    {
+        struct Entity { float x, y, z, yaw; uint16_t hp; uint8_t state, team; };
+
+        std::mt19937 random(1);
+        std::uniform_real_distribution<float> position(-500.0f, 500.0f);
+        std::vector<Entity> entities(128);
+        for(auto& entity : entities) entity = { position(random), 0.0f, position(random), 0.0f, 100, 0, (uint8_t)(random() % 4) };
+
+        std::vector<std::vector<uint8_t>> snapshots;
+        for(size_t tick = 0; tick < count; tick++)
+        {
+            for(int moved = 0; moved < 8; moved++)
+            {
+                auto& entity = entities[random() % entities.size()];
+                entity.x += 0.25f;
+                entity.yaw += 0.1f;
+                entity.state = (uint8_t)(random() % 3);
+            }
+
+            std::vector<uint8_t> data;
+            writeU32(data, UploadId);
+            writeU32(data, (uint32_t)tick);
+            for(size_t i = 0; i < entities.size(); i++)
+            {
+                const auto& entity = entities[i];
+                writeU32(data, (uint32_t)i);
+                writeF32(data, entity.x);
+                writeF32(data, entity.y);
+                writeF32(data, entity.z);
+                writeF32(data, entity.yaw);
+                data.push_back((uint8_t)(entity.hp >> 8));
+                data.push_back((uint8_t)entity.hp);
+                data.push_back(entity.state);
+                data.push_back(entity.team);
+            }
+            snapshots.push_back(std::move(data));
+        }
+        return snapshots;
+    }
+
+    // 縮まないデータ（圧縮を試して諦めるまでのコスト）
+    std::vector<std::vector<uint8_t>> makeRandom(size_t count, size_t size)
+    {
+        std::mt19937 random(2);
+        std::vector<std::vector<uint8_t>> messages;
+        for(size_t n = 0; n < count; n++)
+        {
+            std::vector<uint8_t> data;
+            writeU32(data, UploadId);
+            while(data.size() < size) data.push_back((uint8_t)random());
+            messages.push_back(std::move(data));
+        }
+        return messages;
+    }
+
+    bool run(const char* name, uint16_t port, std::vector<std::vector<uint8_t>> messages)
+    {
+        gMessages = std::move(messages);
+        gUploaded = 0;
+
+        MessageServer server(port);
+        TCPServer::ConnectionOptions options;
+        options.framed = true;
+        options.compression = true;
+        server.setConnectionOptions(options);
+        server.registerView<Upload>(UploadId);
+        server.registerView<Download>(DownloadId);
+        if(!server.start()) return false;
+
+        int fd = Bench::connectTcp(port);
+        if(fd < 0) return false;
+
+        uint8_t flags;
+        std::vector<uint8_t> payload;
+        if(!Bench::readFrame(fd, flags, payload) || !(flags & Frame::FlagControl)) return false;
+
+        std::vector<uint8_t> out;
+        const uint8_t hello[] = { (uint8_t)Frame::Control::Hello, Frame::CapabilityCompression };
+        Bench::appendFrame(out, Frame::FlagControl, hello);
+
+        std::vector<uint8_t> request;
+        writeU32(request, DownloadId);
+        writeU32(request, Count);
+        Bench::appendFrame(out, 0, request);
+        if(!Bench::writeAll(fd, out.data(), out.size())) return false;
+
+        // 下り
+        double cpuBegin = Bench::cpuSeconds();
+        Bench::Stopwatch downWatch;
+        uint64_t rawBytes = 0;
+        uint64_t wireBytes = 0;
+        std::vector<uint8_t> raw;
+        for(uint32_t i = 0; i < Count; i++)
+        {
+            if(!Bench::readFrame(fd, flags, payload)) return false;
+            wireBytes += payload.size();
+            if(flags & Frame::FlagCompressed)
+            {
+                raw.clear();
+                if(payload.size() < 4 || !Compression::decompress(std::span(payload).subspan(4), Bench::getU32(payload.data()), raw)) return false;
+                rawBytes += raw.size();
+            }
+            else
+            {
+                rawBytes += payload.size();
+            }
+        }
+        double downSeconds = downWatch.seconds();
+        double downCpu = Bench::cpuSeconds() - cpuBegin;
+        TCPServer::CompressionStats downStats = server.getCompressionStats();
+
+        // 上り（クライアント側の圧縮は計測の外で済ませておく）
+        out.clear();
+        uint64_t upWireBytes = 0;
+        for(uint32_t i = 0; i < Count; i++)
+        {
+            const auto& message = gMessages[i % gMessages.size()];
+            std::vector<uint8_t> body;
+            writeU32(body, (uint32_t)message.size());
+            if(Compression::compress(message, body))
+            {
+                Bench::appendFrame(out, Frame::FlagCompressed, body);
+                upWireBytes += body.size();
+            }
+            else
+            {
+                Bench::appendFrame(out, 0, message);
+                upWireBytes += message.size();
+            }
+        }
+
+        cpuBegin = Bench::cpuSeconds();
+        Bench::Stopwatch upWatch;
+        if(!Bench::writeAll(fd, out.data(), out.size())) return false;
+        while(gUploaded.load(std::memory_order_relaxed) < Count) std::this_thread::yield();
+        double upSeconds = upWatch.seconds();
+        double upCpu = Bench::cpuSeconds() - cpuBegin;
+        TCPServer::CompressionStats upStats = server.getCompressionStats();
+
+        close(fd);
+        server.stop();
+
+        double megabytes = rawBytes / 1048576.0;
+        std::printf("%-9s down: %6.1f MB -> %6.1f MB (ratio %.3f)  compress %6.2f ms/MB  %7.1f MB/s  process CPU %6.2f ms/MB\n",
+            name, megabytes, wireBytes / 1048576.0, downStats.ratio(), downStats.compressNanosecondsPerMB() / 1e6,
+            megabytes / downSeconds, downCpu * 1e3 / megabytes);
+        std::printf("%-9s up:   %6.1f MB -> %6.1f MB (ratio %.3f)  decompress %4.2f ms/MB  %7.1f MB/s  process CPU %6.2f ms/MB\n",
+            name, megabytes, upWireBytes / 1048576.0, (double)upWireBytes / rawBytes, upStats.decompressNanosecondsPerMB() / 1e6,
+            megabytes / upSeconds, upCpu * 1e3 / megabytes);
+        return true;
+    }
+}
+
+int main()
+{
+    std::printf("%u messages per direction, compressionThreshold %u bytes\n", Count, (unsigned)TCPServer::ConnectionOptions{}.compressionThreshold);
+
+    if(!run("snapshot", 20201, makeSnapshots(256))) { std::printf("snapshot: failed\n"); return 1; }
+    if(!run("random", 20202, makeRandom(256, 3076))) { std::printf("random: failed\n"); return 1; }
+    return 0;
+}
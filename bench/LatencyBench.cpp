@@ -0,0 +1,150 @@
+// 1 接続の ping-pong で往復時間（p50 / p99）と、そのときのプロセスの CPU 使用率を測る
+// 回ってから眠る設定（spinMicroseconds）が遅延をどれだけ縮め、CPU をどれだけ使うかを比べる
+//   think 0: 返事が来たらすぐ次を送る（詰まった負荷）
+//   think N: 送るたびに N マイクロ秒空ける（まばらな負荷。budget を超えると眠る）
+#include <cstdio>
+#include <thread>
+
+#include "BenchClient.hpp"
+#include "StardustLib/MessageServer.hpp"
+
+using namespace StardustLib;
+
+namespace
+{
+    constexpr uint32_t PingId = 3;
+    constexpr uint32_t PongId = 4;
+    constexpr int Count = 5000;
+
+    struct Pong : MessageBase
+    {
+        using MessageBase::MessageBase;
+        uint32_t sequence = 0;
+
+        void serialize(BufferWriter& writer) const override
+        {
+            writer.write<uint32_t>(PongId);
+            writer.write<uint32_t>(sequence);
+        }
+
+        void deserialize(BufferReader&) override {}
+    };
+
+    struct Ping : MessageView
+    {
+        using MessageView::MessageView;
+        static constexpr size_t Size = 4;
+
+        void process() override
+        {
+            Pong pong(getClientId(), getServer());
+            pong.sequence = field<uint32_t>(0);
+            pong.send();
+        }
+    };
+
+    struct Config
+    {
+        const char* name;
+        uint32_t spinMicroseconds;
+        bool runToCompletion;
+        bool pinned;
+    };
+
+    bool run(uint16_t port, const Config& config, bool useIoUring, int thinkMicroseconds)
+    {
+        unsigned cpus = std::thread::hardware_concurrency();
+
+        MessageServer server(port);
+        TCPServer::ConnectionOptions options;
+        options.framed = true;
+        options.useIoUring = useIoUring;
+        options.spinMicroseconds = config.spinMicroseconds;
+        options.runToCompletion = config.runToCompletion;
+        if(config.pinned)
+        {
+            // CPU 0 はクライアント（このスレッド）に残す
+            options.busyPollMicroseconds = 50;
+            if(cpus >= 3)
+            {
+                options.transferCpu = 1;
+                options.processCpu = 2;
+            }
+        }
+        server.setConnectionOptions(options);
+        server.registerView<Ping>(PingId);
+        if(!server.start()) return false;
+
+        int fd = Bench::connectTcp(port);
+        if(fd < 0) return false;
+
+        std::vector<double> roundTrips;
+        roundTrips.reserve(Count);
+        uint8_t flags;
+        std::vector<uint8_t> payload;
+
+        double cpuBegin = Bench::cpuSeconds();
+        Bench::Stopwatch watch;
+        for(int i = 0; i < Count; i++)
+        {
+            uint8_t frame[Frame::HeaderSize + 8];
+            Bench::putU32(frame, 9);
+            frame[Frame::LengthSize] = 0;
+            Bench::putU32(frame + Frame::HeaderSize, PingId);
+            Bench::putU32(frame + Frame::HeaderSize + 4, (uint32_t)i);
+
+            Bench::Stopwatch roundTrip;
+            if(!Bench::writeAll(fd, frame, sizeof(frame))) return false;
+            if(!Bench::readFrame(fd, flags, payload) || payload.size() != 8 || Bench::getU32(payload.data() + 4) != (uint32_t)i) return false;
+            roundTrips.push_back(roundTrip.seconds() * 1e6);
+
+            if(thinkMicroseconds > 0) std::this_thread::sleep_for(std::chrono::microseconds(thinkMicroseconds));
+        }
+        double seconds = watch.seconds();
+        double cpu = Bench::cpuSeconds() - cpuBegin;
+        TCPServer::SpinStats spin = server.getSpinStats();
+
+        std::printf("%-20s %-5s think %4dus  p50 %7.1fus  p99 %7.1fus  CPU/wall %5.2f  parks %6llu/%6llu  spin %6.1f ms\n",
+            config.name, useIoUring ? "uring" : "poll", thinkMicroseconds,
+            Bench::percentile(roundTrips, 0.50), Bench::percentile(roundTrips, 0.99), cpu / seconds,
+            (unsigned long long)spin.transfer.parks, (unsigned long long)spin.process.parks,
+            (spin.transfer.spinNanoseconds + spin.process.spinNanoseconds) / 1e6);
+
+        close(fd);
+        server.stop();
+        return true;
+    }
+}
+
+int main()
+{
+    unsigned cpus = std::thread::hardware_concurrency();
+    std::printf("%d round trips per run, hardware_concurrency %u\n", Count, cpus);
+    if(cpus == 1) std::printf("note: single core, so start() turns spinning off and the spin rows behave like default\n");
+    if(cpus < 3) std::printf("note: fewer than 3 cores, so the pinned rows only add SO_BUSY_POLL\n");
+
+    const Config configs[] =
+    {
+        { "default", 0, false, false },
+        { "spin 200us", 200, false, false },
+        { "spin 200us + rtc", 200, true, false },
+        { "spin + pin + busy", 200, false, true },
+    };
+
+    uint16_t port = 20251;
+    for(int think : { 0, 200 })
+    {
+        for(bool useIoUring : { false, true })
+        {
+            for(const Config& config : configs)
+            {
+                if(!run(port++, config, useIoUring, think))
+                {
+                    std::printf("%s: failed\n", config.name);
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
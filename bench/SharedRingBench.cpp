@@ -0,0 +1,160 @@
+// 同じマシン上のクライアントから小さなメッセージを流し込み、経路ごとのスループットを比べる
+//   tcp: ループバック / unix: UNIX ドメインソケット / shm: UNIX ソケットで受け取った共有メモリのリング
+#include <poll.h>
+
+#include <atomic>
+#include <cstdio>
+#include <thread>
+
+#include "BenchClient.hpp"
+#include "StardustLib/MessageServer.hpp"
+#include "StardustLib/SharedRing.hpp"
+
+using namespace StardustLib;
+
+namespace
+{
+    constexpr uint32_t PingId = 5;
+    constexpr uint32_t Count = 300000;
+    constexpr size_t WriteSize = 4096;
+    constexpr const char* SocketPath = "/tmp/stardust-bench.sock";
+
+    std::atomic<uint32_t> gReceived{0};
+
+    struct Ping : MessageView
+    {
+        using MessageView::MessageView;
+        static constexpr size_t Size = 4;
+
+        void process() override { gReceived.fetch_add(1, std::memory_order_relaxed); }
+    };
+
+    enum class Transport { Tcp, Unix, Shared };
+
+    std::vector<uint8_t> makeStream()
+    {
+        std::vector<uint8_t> stream;
+        for(uint32_t i = 0; i < Count; i++)
+        {
+            uint8_t payload[8];
+            Bench::putU32(payload, PingId);
+            Bench::putU32(payload + 4, i);
+            Bench::appendFrame(stream, 0, payload);
+        }
+        return stream;
+    }
+
+    // サーバーが最初に送ってくる SharedMemory 制御フレームと 3 つの fd を受け取り、切り替えを返す
+    std::unique_ptr<SharedChannel> receiveChannel(int fd)
+    {
+        uint8_t frame[Frame::HeaderSize + 5];
+        iovec iov{ frame, sizeof(frame) };
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * 3)];
+        msghdr message{};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        ssize_t n = recvmsg(fd, &message, MSG_WAITALL);
+        cmsghdr* header = CMSG_FIRSTHDR(&message);
+        if(n != (ssize_t)sizeof(frame) || !header || header->cmsg_type != SCM_RIGHTS) return nullptr;
+        if(frame[Frame::HeaderSize] != (uint8_t)Frame::Control::SharedMemory) return nullptr;
+
+        int fds[3];
+        std::memcpy(fds, CMSG_DATA(header), sizeof(fds));
+        auto channel = SharedChannel::attach(fds[0], fds[1], fds[2], Bench::getU32(frame + Frame::HeaderSize + 1));
+        if(!channel) return nullptr;
+
+        // 切り替えたことをソケットで伝える。これより後はリングにだけ書く
+        std::vector<uint8_t> attached;
+        const uint8_t payload[] = { (uint8_t)Frame::Control::SharedMemory };
+        Bench::appendFrame(attached, Frame::FlagControl, payload);
+        if(!Bench::writeAll(fd, attached.data(), attached.size())) return nullptr;
+        return channel;
+    }
+
+    bool writeShared(SharedChannel& channel, const uint8_t* data, size_t size)
+    {
+        while(size > 0)
+        {
+            size_t written = 0;
+            if(!channel.outbound().write(data, size, written)) return false;
+            if(written > 0)
+            {
+                channel.notifyAfterWrite();
+                data += written;
+                size -= written;
+            }
+            else if(channel.prepareWait(true))
+            {
+                // 満杯なのでサーバーが読むまで待つ
+                pollfd waitFd{ channel.getWaitFd(), POLLIN, 0 };
+                poll(&waitFd, 1, 10);
+                channel.consumeWakeup();
+            }
+        }
+        return true;
+    }
+
+    bool run(const char* name, uint16_t port, Transport transport, bool useIoUring, const std::vector<uint8_t>& stream)
+    {
+        gReceived = 0;
+
+        MessageServer server(port);
+        TCPServer::ConnectionOptions options;
+        options.framed = true;
+        options.useIoUring = useIoUring;
+        if(transport != Transport::Tcp) options.unixSocketPath = SocketPath;
+        if(transport == Transport::Shared) options.sharedRingSize = 1 << 20;
+        server.setConnectionOptions(options);
+        server.registerView<Ping>(PingId);
+        if(!server.start()) return false;
+
+        int fd = transport == Transport::Tcp ? Bench::connectTcp(port) : Bench::connectUnix(SocketPath);
+        if(fd < 0) return false;
+
+        std::unique_ptr<SharedChannel> channel;
+        if(transport == Transport::Shared && !(channel = receiveChannel(fd))) return false;
+
+        double cpuBegin = Bench::cpuSeconds();
+        Bench::Stopwatch watch;
+        for(size_t offset = 0; offset < stream.size(); offset += WriteSize)
+        {
+            size_t size = std::min(WriteSize, stream.size() - offset);
+            bool ok = channel ? writeShared(*channel, stream.data() + offset, size) : Bench::writeAll(fd, stream.data() + offset, size);
+            if(!ok) return false;
+        }
+        while(gReceived.load(std::memory_order_relaxed) < Count) std::this_thread::yield();
+        double seconds = watch.seconds();
+        double cpu = Bench::cpuSeconds() - cpuBegin;
+
+        std::printf("%-5s %-5s %7.1f ms  %5.2f Mmsg/s  %6.1f MB/s  CPU %5.0f ns/msg\n",
+            name, useIoUring ? "uring" : "poll", seconds * 1e3, Count / seconds / 1e6,
+            stream.size() / seconds / 1048576.0, cpu * 1e9 / Count);
+
+        channel.reset();
+        close(fd);
+        server.stop();
+        return true;
+    }
+}
+
+int main()
+{
+    std::printf("%u messages of %zu bytes on the wire, written %zu bytes at a time\n", Count, (size_t)Frame::HeaderSize + 8, WriteSize);
+
+    std::vector<uint8_t> stream = makeStream();
+    uint16_t port = 20211;
+    for(bool useIoUring : { false, true })
+    {
+        if(!run("tcp", port++, Transport::Tcp, useIoUring, stream)
+            || !run("unix", port++, Transport::Unix, useIoUring, stream)
+            || !run("shm", port++, Transport::Shared, useIoUring, stream))
+        {
+            std::printf("failed\n");
+            return 1;
+        }
+    }
+    return 0;
+}
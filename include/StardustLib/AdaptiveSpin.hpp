@@ -0,0 +1,116 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+namespace StardustLib
+{
+    // 仕事がない状態が budget 続くまではブロックせずに回り、過ぎたら眠る
+    // 眠ってすぐに起こされたら budget を伸ばし、長く眠っていたら縮める
+    // 1 つのスレッドから使う（統計だけは他のスレッドから読める）
+    class AdaptiveSpin
+    {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        struct Stats
+        {
+            uint64_t parks = 0;           // スピンを諦めて眠った回数
+            uint64_t spinNanoseconds = 0; // 仕事を待って回っていた時間の合計
+            uint64_t budgetNanoseconds = 0;
+        };
+
+    private:
+        uint64_t maxNs = 0;
+        std::atomic<uint64_t> budgetNs = 0;
+        Clock::time_point idleSince;
+        Clock::time_point parkedAt;
+        bool idle = false;
+        bool parked = false;
+
+        std::atomic<uint64_t> statParks = 0;
+        std::atomic<uint64_t> statSpinNs = 0;
+
+        static uint64_t elapsedNs(Clock::time_point from, Clock::time_point to)
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count();
+        }
+
+    public:
+        void configure(uint64_t maxMicroseconds)
+        {
+            maxNs = maxMicroseconds * 1000;
+            budgetNs = maxNs / 4;
+            idle = false;
+            parked = false;
+        }
+
+        bool enabled() const { return maxNs != 0; }
+
+        // 回っている間に 1 回ずつ呼ぶ。SMT の相方に実行資源を譲る
+        static void relax()
+        {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#elif defined(__aarch64__)
+            asm volatile("yield");
+#else
+            std::this_thread::yield();
+#endif
+        }
+
+        // 待つ直前に呼ぶ。true ならブロックせずにもう一度見に行く
+        bool shouldSpin()
+        {
+            if(maxNs == 0) return false;
+
+            auto now = Clock::now();
+            if(!idle)
+            {
+                idle = true;
+                idleSince = now;
+            }
+            if(parked) return false;
+            if(elapsedNs(idleSince, now) < budgetNs.load(std::memory_order_relaxed)) return true;
+
+            statSpinNs.fetch_add(elapsedNs(idleSince, now), std::memory_order_relaxed);
+            statParks.fetch_add(1, std::memory_order_relaxed);
+            parked = true;
+            parkedAt = now;
+            return false;
+        }
+
+        // 何か処理したら呼ぶ
+        void onWork()
+        {
+            if(!idle) return;
+
+            auto now = Clock::now();
+            if(parked)
+            {
+                uint64_t slept = elapsedNs(parkedAt, now);
+                uint64_t budget = budgetNs.load(std::memory_order_relaxed);
+                if(slept < budget) budgetNs.store(std::min(budget * 2, maxNs), std::memory_order_relaxed);
+                else if(slept > budget * 8) budgetNs.store(std::max(budget / 2, maxNs / 16), std::memory_order_relaxed);
+            }
+            else
+            {
+                statSpinNs.fetch_add(elapsedNs(idleSince, now), std::memory_order_relaxed);
+            }
+            idle = false;
+            parked = false;
+        }
+
+        Stats getStats() const
+        {
+            Stats stats;
+            stats.parks = statParks.load(std::memory_order_relaxed);
+            stats.spinNanoseconds = statSpinNs.load(std::memory_order_relaxed);
+            stats.budgetNanoseconds = budgetNs.load(std::memory_order_relaxed);
+            return stats;
+        }
+    };
+}
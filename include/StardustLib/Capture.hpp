@@ -0,0 +1,115 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace StardustLib
+{
+    // 受信したメッセージのバイナリログ（整数はワイヤ形式と同じくビッグエンディアン）
+    //   ヘッダー: [u32 Magic][u32 Version]
+    //   レコード: [u32 size][u32 clientId][u64 timestampNs][u8 delivery][data (size bytes)]
+    // timestampNs はキャプチャ開始からの経過時間、delivery は TCPServer::Delivery の値
+    class Capture
+    {
+    public:
+        static constexpr uint32_t Magic = 0x53444350; // "SDCP"
+        static constexpr uint32_t Version = 1;
+        static constexpr size_t FileHeaderSize = 8;
+        static constexpr size_t RecordHeaderSize = 17;
+
+        struct Record
+        {
+            uint32_t clientId = 0;
+            uint64_t timestampNs = 0;
+            uint8_t delivery = 0;
+            std::span<const uint8_t> data;
+        };
+
+        struct Stats
+        {
+            uint64_t records = 0;
+            uint64_t bytes = 0;   // ヘッダーを含むファイル上のサイズ
+            uint64_t dropped = 0; // 書き出しが追いつかずに捨てたレコード
+            bool failed = false;  // ファイルに書けなくなって記録を止めた（そのファイルは replay で開けない）
+        };
+    };
+
+    // 受信側はメモリ上のバッファに詰めるだけで、ファイルへの書き出しは専用スレッドが行う
+    // Linux ではファイルを mmap して伸ばしながら書く（それ以外は stdio）
+    class CaptureWriter
+    {
+    private:
+        std::vector<uint8_t> pending;
+        size_t maxPendingBytes = 0;
+        std::mutex pendingMtx;
+        std::condition_variable pendingCv;
+        std::chrono::steady_clock::time_point startTime;
+
+        std::atomic<uint64_t> statRecords = 0;
+        std::atomic<uint64_t> statBytes = 0;
+        std::atomic<uint64_t> statDropped = 0;
+        std::atomic<bool> failed = false;
+
+        int fd = -1;
+        std::FILE* file = nullptr;
+        uint8_t* mapped = nullptr;
+        size_t mappedSize = 0;
+        size_t written = 0;
+
+        std::jthread writerThread;
+
+        void runWriterLoop(std::stop_token token);
+        bool writeOut(std::span<const uint8_t> data);
+
+    public:
+        CaptureWriter() = default;
+        ~CaptureWriter() { close(); }
+
+        CaptureWriter(const CaptureWriter&) = delete;
+        CaptureWriter& operator=(const CaptureWriter&) = delete;
+
+        // 既存のファイルは上書きする。maxPendingBytes を超えて溜まった分は捨てて dropped に数える
+        bool open(const std::string& path, size_t maxPendingBytes = 0x4000000);
+        void close();
+
+        // 書き出しに失敗した後は何も積まずに dropped に数える
+        void append(uint32_t clientId, uint8_t delivery, std::span<const uint8_t> data);
+
+        Capture::Stats getStats() const;
+        bool hasFailed() const { return failed.load(std::memory_order_relaxed); }
+    };
+
+    class CaptureReader
+    {
+    private:
+        std::vector<uint8_t> contents; // mmap できない環境ではここに読み込む
+        const uint8_t* data = nullptr;
+        size_t size = 0;
+        size_t position = 0;
+        void* mapped = nullptr;
+
+        void release();
+
+    public:
+        CaptureReader() = default;
+        ~CaptureReader() { release(); }
+
+        CaptureReader(const CaptureReader&) = delete;
+        CaptureReader& operator=(const CaptureReader&) = delete;
+
+        bool open(const std::string& path);
+
+        // 末尾か壊れたレコードで false。out.data は reader が生きている間だけ有効
+        bool next(Capture::Record& out);
+        void rewind() { position = Capture::FileHeaderSize; }
+    };
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace StardustLib
+{
+    // LZ4 ブロック形式互換の軽量コーデック（外部依存なし）
+    class Compression
+    {
+    public:
+        static size_t compressBound(size_t size) noexcept { return size + size / 255 + 16; }
+
+        // dst の末尾に追記する。圧縮しても小さくならない場合は false
+        static bool compress(std::span<const uint8_t> src, std::vector<uint8_t>& dst);
+
+        // rawSize ぴったりに展開できた場合のみ true（不正な入力は拒否）
+        static bool decompress(std::span<const uint8_t> src, size_t rawSize, std::vector<uint8_t>& dst);
+    };
+}
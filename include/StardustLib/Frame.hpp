@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace StardustLib
+{
+    // framed 接続のワイヤ形式
+    //   [u32 BE length][u8 flags][payload (length - 1 bytes)]
+    // FlagCompressed のとき payload は [u32 BE rawSize][LZ ブロック]
+    // FlagControl のとき payload は [u8 Control][...]
+    // 大きなフレームは同じレーン番号のチャンクに分割され、最後以外に FlagContinued が付く
+    // UDP データグラムは [u32 BE clientId][u64 BE token][u32 BE sequence][message]（sequence 0 は順序なし）
+    // 共有メモリへの切り替え（Unix 接続で sharedRingSize が 0 以外のとき）
+    //   サーバーは最初のフレームとして SharedMemory を送り、以後サーバーからのものはすべてリングに書く
+    //   クライアントはリングに書く前に、ソケットへ SharedMemory（payload は [u8 0x02] だけ）を返す
+    //   サーバーはそれまでソケットだけを読む。それ以後にソケットへ来たものはプロトコル違反として切断する
+    class Frame
+    {
+    public:
+        static constexpr size_t LengthSize = 4;
+        static constexpr size_t HeaderSize = LengthSize + 1;
+        static constexpr size_t DatagramHeaderSize = 16;
+
+        enum Flag : uint8_t
+        {
+            FlagCompressed = 0x01,
+            FlagContinued = 0x02,
+            FlagControl = 0x80,
+        };
+
+        static constexpr uint8_t LaneShift = 4;
+        static constexpr uint8_t LaneMask = 0x30;
+
+        enum class Control : uint8_t
+        {
+            Hello = 0x00,    // [u8 capabilities]
+            Datagram = 0x01, // [u16 port][u32 clientId][u64 token]
+            SharedMemory = 0x02, // [u32 ringCapacity]。Unix ソケットの SCM_RIGHTS で memfd, serverEventFd, clientEventFd を渡す（クライアントからは payload なしで切り替えの印）
+            Ping = 0x03,     // [u32 nonce]。受け取った側は同じ内容の Pong を返す
+            Pong = 0x04,     // [u32 nonce]
+        };
+
+        enum Capability : uint8_t
+        {
+            CapabilityCompression = 0x01,
+        };
+    };
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace StardustLib
+{
+    // io_uring の最小限のラッパー（Linux のみ。liburing には依存しない）
+    // 使えない環境では init() が false を返すので、呼び出し側は poll に戻る
+    class IoUring
+    {
+    public:
+        struct Completion
+        {
+            uint64_t userData;
+            int32_t result;
+            uint32_t flags;
+        };
+
+    private:
+        int ringFd = -1;
+        int wakeFd = -1;
+
+        void* ringMemory = nullptr;
+        size_t ringMemorySize = 0;
+        void* sqeMemory = nullptr;
+        size_t sqeMemorySize = 0;
+
+        unsigned* sqHead = nullptr;
+        unsigned* sqTail = nullptr;
+        unsigned* sqArray = nullptr;
+        unsigned sqMask = 0;
+        unsigned sqEntries = 0;
+        unsigned sqeTail = 0;
+
+        unsigned* cqHead = nullptr;
+        unsigned* cqTail = nullptr;
+        void* cqes = nullptr;
+        unsigned cqMask = 0;
+
+        void* bufferRing = nullptr;
+        size_t bufferRingSize = 0;
+        std::vector<uint8_t> bufferMemory;
+        unsigned bufferCount = 0;
+        unsigned bufferSize = 0;
+        uint16_t bufferTail = 0;
+
+        void* getSqe();
+        int enter(unsigned toSubmit, bool wait, int timeoutMs);
+        void addBuffer(uint16_t bufferId);
+        bool probeMultishotRecv();
+        void release();
+
+    public:
+        IoUring() = default;
+        ~IoUring() { release(); }
+
+        IoUring(const IoUring&) = delete;
+        IoUring& operator=(const IoUring&) = delete;
+
+        // bufferCount は 2 のべき乗
+        bool init(unsigned entries, unsigned bufferCount, unsigned bufferSize);
+
+        // 投入キューが埋まっていて積めなければ false（何も積まれていないので、呼び出し側が後でやり直す）
+        bool prepareAcceptMultishot(int fd, uint64_t userData);
+        bool prepareRecvMultishot(int fd, uint64_t userData);
+        bool prepareSend(int fd, const void* data, size_t size, uint64_t userData);
+        bool preparePollMultishot(int fd, uint64_t userData);
+        bool prepareCancelFd(int fd, uint64_t userData);
+
+        // 溜めた SQE をまとめて 1 回で投入し、完了を待つ（timeoutMs が 0 なら待たない）
+        int submitAndWait(int timeoutMs);
+        void reap(std::vector<Completion>& out);
+
+        static bool hasMore(uint32_t flags);
+        static bool hasBuffer(uint32_t flags);
+
+        // 提供バッファ。処理が終わったら recycleBuffer で返す
+        std::span<const uint8_t> buffer(uint32_t flags, int32_t length) const;
+        void recycleBuffer(uint32_t flags);
+
+        // 他スレッドから完了待ちを起こす
+        int getWakeFd() const { return wakeFd; }
+        void wake();
+        void consumeWake();
+    };
+}
@@ -19,6 +19,8 @@ namespace StardustLib
 
     public:
         MessageBase(uint32_t clientId, std::shared_ptr<TCPServer> server) : mClientId(clientId), mServer(server) {}
+        // MessageView::process から返信するとき用。所有しないので、サーバーより長く持たないこと
+        MessageBase(uint32_t clientId, TCPServer* server) : mClientId(clientId), mServer(std::shared_ptr<TCPServer>(), server) {}
 
         virtual ~MessageBase() = default;
 
@@ -2,18 +2,126 @@
 
 #include <functional>
 #include <memory>
+#include <span>
 #include <unordered_map>
+#include <vector>
 #include "StardustLib/MessageBase.hpp"
+#include "StardustLib/MessageView.hpp"
 
 namespace StardustLib
 {
     class MessageFactory
     {
     public:
+        struct SendTraits
+        {
+            TCPServer::Priority priority = TCPServer::Priority::Unspecified;
+            TCPServer::Delivery delivery = TCPServer::Delivery::Unspecified;
+        };
+
         template<Message T>
-        void registerType(uint32_t id)
+        void registerType(uint32_t id, TCPServer::Priority priority = TCPServer::Priority::Unspecified, TCPServer::Delivery delivery = TCPServer::Delivery::Unspecified)
         {
             creators[id] = [](uint32_t clientId, std::shared_ptr<TCPServer> server){ return std::make_unique<T>(clientId, server); };
+            setPriority(id, priority);
+            setDelivery(id, delivery);
+        }
+
+        template<View T>
+        void registerView(uint32_t id, TCPServer::Priority priority = TCPServer::Priority::Unspecified, TCPServer::Delivery delivery = TCPServer::Delivery::Unspecified)
+        {
+            setPriority(id, priority);
+            setDelivery(id, delivery);
+            viewHandlers[id] = [](uint32_t clientId, const std::shared_ptr<TCPServer>& server, std::span<const uint8_t> bytes)
+            {
+                if(bytes.size() < T::Size) return;
+                T view(clientId, server.get(), bytes);
+                view.process();
+            };
+        }
+
+        // View として登録されていれば処理して true を返す
+        bool dispatchView(uint32_t id, uint32_t clientId, const std::shared_ptr<TCPServer>& server, std::span<const uint8_t> bytes) const
+        {
+            if(viewHandlers.empty()) return false;
+
+            auto it = viewHandlers.find(id);
+            if (it != viewHandlers.end())
+            {
+                (it->second)(clientId, server, bytes);
+                return true;
+            }
+            return false;
+        }
+
+        // 同じ ID の連続したメッセージを T::processBatch(std::span<T>) でまとめて処理する
+        template<Message T> requires requires(std::span<T> batch) { T::processBatch(batch); }
+        void registerBatchType(uint32_t id)
+        {
+            batchHandlers[id] = [](std::span<const TCPServer::Packet> packets, const std::shared_ptr<TCPServer>& server)
+            {
+                std::vector<T> messages;
+                messages.reserve(packets.size());
+                for(const auto& packet : packets)
+                {
+                    BufferReader reader(packet.data);
+                    reader.read<uint32_t>();
+                    messages.emplace_back(packet.clientId, server).deserialize(reader);
+                }
+                T::processBatch(std::span<T>(messages));
+            };
+        }
+
+        // View 版。T::processBatch(std::span<const T>) はデコードせずに受信バッファを読む
+        template<View T> requires requires(std::span<const T> batch) { T::processBatch(batch); }
+        void registerBatchView(uint32_t id)
+        {
+            batchHandlers[id] = [](std::span<const TCPServer::Packet> packets, const std::shared_ptr<TCPServer>& server)
+            {
+                std::vector<T> views;
+                views.reserve(packets.size());
+                for(const auto& packet : packets)
+                {
+                    if(packet.data.size() < sizeof(uint32_t) + T::Size) continue;
+                    std::span<const uint8_t> bytes(packet.data.data() + sizeof(uint32_t), packet.data.size() - sizeof(uint32_t));
+                    views.emplace_back(packet.clientId, server.get(), bytes);
+                }
+                if(!views.empty()) T::processBatch(std::span<const T>(views));
+            };
+        }
+
+        bool hasBatch(uint32_t id) const
+        {
+            return !batchHandlers.empty() && batchHandlers.contains(id);
+        }
+
+        bool dispatchBatch(uint32_t id, std::span<const TCPServer::Packet> packets, const std::shared_ptr<TCPServer>& server) const
+        {
+            auto it = batchHandlers.find(id);
+            if (it != batchHandlers.end())
+            {
+                (it->second)(packets, server);
+                return true;
+            }
+            return false;
+        }
+
+        // 送信時にどのレーンに積むか
+        void setPriority(uint32_t id, TCPServer::Priority priority)
+        {
+            if(priority != TCPServer::Priority::Unspecified) sendTraits[id].priority = priority;
+        }
+
+        // 送信時に TCP と UDP のどちらを使うか
+        void setDelivery(uint32_t id, TCPServer::Delivery delivery)
+        {
+            if(delivery != TCPServer::Delivery::Unspecified) sendTraits[id].delivery = delivery;
+        }
+
+        const SendTraits* sendTraitsOf(uint32_t id) const
+        {
+            auto it = sendTraits.find(id);
+            return it != sendTraits.end() ? &it->second : nullptr;
         }
 
         std::unique_ptr<MessageBase> create(uint32_t id, uint32_t clientId, std::shared_ptr<TCPServer> server) const
@@ -29,5 +137,13 @@ namespace StardustLib
     private:
         using Creator = std::function<std::unique_ptr<MessageBase>(uint32_t clientId, std::shared_ptr<TCPServer> server)>;
         std::unordered_map<uint32_t, Creator> creators;
+
+        using ViewHandler = std::function<void(uint32_t clientId, const std::shared_ptr<TCPServer>& server, std::span<const uint8_t> bytes)>;
+        std::unordered_map<uint32_t, ViewHandler> viewHandlers;
+
+        using BatchHandler = std::function<void(std::span<const TCPServer::Packet> packets, const std::shared_ptr<TCPServer>& server)>;
+        std::unordered_map<uint32_t, BatchHandler> batchHandlers;
+
+        std::unordered_map<uint32_t, SendTraits> sendTraits;
     };
 }
\ No newline at end of file
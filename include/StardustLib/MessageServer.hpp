@@ -7,8 +7,12 @@
 #include <vector>
 #include <mutex>
 #include <any>
+#include <chrono>
+#include <string>
+#include <thread>
 #include "StardustLib/Buffer.hpp"
 #include "StardustLib/TCPServer.hpp"
+#include "StardustLib/Capture.hpp"
 #include "StardustLib/MessageBase.hpp"
 #include "StardustLib/MessageFactory.hpp"
 
@@ -16,11 +20,68 @@ namespace StardustLib
 {
     class MessageServer
     {
+    public:
+        enum class ReplaySpeed
+        {
+            Original,  // 記録されたときの間隔で流す
+            Unlimited, // 待たずにできるだけ速く流す
+        };
+
+        struct ReplayStats
+        {
+            uint64_t messages = 0;
+            uint64_t bytes = 0;
+            uint64_t elapsedNanoseconds = 0;
+
+            double messagesPerSecond() const { return elapsedNanoseconds ? messages * 1e9 / elapsedNanoseconds : 0.0; }
+            double megabytesPerSecond() const { return elapsedNanoseconds ? bytes * 1e9 / 1048576.0 / elapsedNanoseconds : 0.0; }
+        };
+
     private:
         MessageFactory mFactory;
 
+        static bool peekId(const TCPServer::Packet& packet, uint32_t& outId)
+        {
+            if(packet.data.size() < sizeof(uint32_t)) return false;
+
+            std::memcpy(&outId, packet.data.data(), sizeof(outId));
+            outId = fromBigEndian(outId);
+            return true;
+        }
+
+        void onPackets(std::span<const TCPServer::Packet> packets)
+        {
+            size_t i = 0;
+            while(i < packets.size())
+            {
+                uint32_t id;
+                if(peekId(packets[i], id) && mFactory.hasBatch(id))
+                {
+                    // 同じ ID が連続する範囲を 1 回で渡す（順序はそのまま保たれる）
+                    size_t end = i + 1;
+                    uint32_t nextId;
+                    while(end < packets.size() && peekId(packets[end], nextId) && nextId == id) end++;
+
+                    mFactory.dispatchBatch(id, packets.subspan(i, end - i), mTCPServer);
+                    i = end;
+                }
+                else
+                {
+                    onPacket(packets[i]);
+                    i++;
+                }
+            }
+        }
+
         void onPacket(const TCPServer::Packet& packet)
         {
+            uint32_t id;
+            if(peekId(packet, id))
+            {
+                std::span<const uint8_t> body(packet.data.data() + sizeof(id), packet.data.size() - sizeof(id));
+                if(mFactory.dispatchView(id, packet.clientId, mTCPServer, body)) return;
+            }
+
             BufferReader buffer(packet.data);
             dispatch(packet.clientId, buffer);
         }
@@ -42,9 +103,19 @@ namespace StardustLib
         explicit MessageServer(uint16_t port)
         {
             mTCPServer = std::make_shared<TCPServer>(port);
-            mTCPServer->setRecvCallback([this](const TCPServer::Packet& p)
+            mTCPServer->setBatchRecvCallback([this](std::span<const TCPServer::Packet> packets)
             {
-                this->onPacket(p);
+                this->onPackets(packets);
+            });
+            mTCPServer->setClassifyCallback([this](TCPServer::Packet& packet)
+            {
+                uint32_t id;
+                if(!peekId(packet, id)) return;
+
+                const auto* traits = mFactory.sendTraitsOf(id);
+                if(!traits) return;
+                if(packet.priority == TCPServer::Priority::Unspecified) packet.priority = traits->priority;
+                if(packet.delivery == TCPServer::Delivery::Unspecified) packet.delivery = traits->delivery;
             });
         }
 
@@ -54,9 +125,120 @@ namespace StardustLib
         }
         
         template<typename T>
-        void registerType(uint32_t id)
+        void registerType(uint32_t id, TCPServer::Priority priority = TCPServer::Priority::Unspecified, TCPServer::Delivery delivery = TCPServer::Delivery::Unspecified)
+        {
+            mFactory.registerType<T>(id, priority, delivery);
+        }
+
+        template<typename T>
+        void registerView(uint32_t id, TCPServer::Priority priority = TCPServer::Priority::Unspecified, TCPServer::Delivery delivery = TCPServer::Delivery::Unspecified)
+        {
+            mFactory.registerView<T>(id, priority, delivery);
+        }
+
+        void setPriority(uint32_t id, TCPServer::Priority priority)
+        {
+            mFactory.setPriority(id, priority);
+        }
+
+        void setDelivery(uint32_t id, TCPServer::Delivery delivery)
+        {
+            mFactory.setDelivery(id, delivery);
+        }
+
+        void setConnectionOptions(TCPServer::ConnectionOptions options)
+        {
+            mTCPServer->setConnectionOptions(options);
+        }
+
+        TCPServer::CompressionStats getCompressionStats() const
+        {
+            return mTCPServer->getCompressionStats();
+        }
+
+        template<typename T>
+        void registerBatchType(uint32_t id)
+        {
+            mFactory.registerBatchType<T>(id);
+        }
+
+        template<typename T>
+        void registerBatchView(uint32_t id)
+        {
+            mFactory.registerBatchView<T>(id);
+        }
+
+        bool startCapture(const std::string& path)
+        {
+            return mTCPServer->startCapture(path);
+        }
+
+        Capture::Stats stopCapture()
+        {
+            return mTCPServer->stopCapture();
+        }
+
+        TCPServer::SpinStats getSpinStats() const
+        {
+            return mTCPServer->getSpinStats();
+        }
+
+        // TCPServer::startCapture で記録したものをソケットを通さずに呼び出し元のスレッドでディスパッチする
+        // start していないサーバーで使う。ハンドラーからの送信は接続がないので失敗する
+        bool replay(const std::string& path, ReplaySpeed speed, ReplayStats* outStats = nullptr, size_t batchSize = 256)
+        {
+            CaptureReader reader;
+            if(!reader.open(path)) return false;
+
+            ReplayStats stats;
+            std::vector<TCPServer::Packet> batch;
+            batch.reserve(batchSize);
+
+            auto begin = std::chrono::steady_clock::now();
+            auto dueAt = [begin](const Capture::Record& record)
+            {
+                return begin + std::chrono::nanoseconds(record.timestampNs);
+            };
+
+            Capture::Record record;
+            bool more = reader.next(record);
+            while(more)
+            {
+                if(speed == ReplaySpeed::Original) std::this_thread::sleep_until(dueAt(record));
+
+                // 期限が来ている分はまとめて渡す（受信ループと同じくバッチ処理が効く）
+                batch.clear();
+                do
+                {
+                    TCPServer::Packet packet;
+                    packet.clientId = record.clientId;
+                    packet.data.assign(record.data.begin(), record.data.end());
+                    packet.delivery = (TCPServer::Delivery)record.delivery;
+                    stats.bytes += record.data.size();
+                    batch.push_back(std::move(packet));
+
+                    more = reader.next(record);
+                } while(more && batch.size() < batchSize
+                    && (speed == ReplaySpeed::Unlimited || dueAt(record) <= std::chrono::steady_clock::now()));
+
+                onPackets(batch);
+                stats.messages += batch.size();
+            }
+
+            stats.elapsedNanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+            if(outStats) *outStats = stats;
+            return true;
+        }
+
+        // fn はメッセージの process() と同じスレッドで呼ばれる
+        TCPServer::TimerId schedule(std::chrono::milliseconds after, std::function<void()> fn)
+        {
+            return mTCPServer->schedule(after, std::move(fn));
+        }
+
+        bool cancel(TCPServer::TimerId id)
         {
-            mFactory.registerType<T>(id);
+            return mTCPServer->cancel(id);
         }
 
         bool start()
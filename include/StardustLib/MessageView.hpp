@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstring>
+#include <memory>
+#include <span>
+#include <type_traits>
+#include "StardustLib/Buffer.hpp"
+#include "StardustLib/TCPServer.hpp"
+
+namespace StardustLib
+{
+    // 受信バッファ上のビッグエンディアン配列を要素ごとに遅延変換して読む
+    template<typename T> requires(std::integral<T> || std::floating_point<T>)
+    class BigEndianSpan
+    {
+    private:
+        std::span<const uint8_t> mBytes;
+
+    public:
+        BigEndianSpan() = default;
+        explicit BigEndianSpan(std::span<const uint8_t> bytes) : mBytes(bytes) {}
+
+        size_t size() const noexcept { return mBytes.size() / sizeof(T); }
+        bool empty() const noexcept { return size() == 0; }
+        std::span<const uint8_t> bytes() const noexcept { return mBytes; }
+
+        T operator[](size_t index) const
+        {
+            T value;
+            std::memcpy(&value, mBytes.data() + index * sizeof(T), sizeof(T));
+            return fromBigEndian(value);
+        }
+    };
+
+    // 固定オフセットのレイアウトを持つメッセージ。deserialize せずに受信バイト列を直接読む
+    // 派生クラスは static constexpr size_t Size（ID を除いた最小サイズ）を定義する
+    class MessageView
+    {
+    private:
+        uint32_t mClientId;
+        TCPServer* mServer; // バッチでは vector に並ぶので参照ではなくポインターで持つ
+        std::span<const uint8_t> mBytes;
+
+    protected:
+        uint32_t getClientId() const { return mClientId; }
+        TCPServer* getServer() const { return mServer; }
+        std::span<const uint8_t> getBytes() const { return mBytes; }
+
+        template<typename T> requires(std::integral<T> || std::floating_point<T>)
+        T field(size_t offset) const
+        {
+            T value{};
+
+            if(offset + sizeof(T) > mBytes.size()) return value;
+
+            std::memcpy(&value, mBytes.data() + offset, sizeof(T));
+            return fromBigEndian(value);
+        }
+
+        template<typename T> requires(std::integral<T> || std::floating_point<T>)
+        BigEndianSpan<T> array(size_t offset, size_t count) const
+        {
+            if(offset > mBytes.size() || count > (mBytes.size() - offset) / sizeof(T)) return {};
+            return BigEndianSpan<T>(mBytes.subspan(offset, count * sizeof(T)));
+        }
+
+        // バッチ内の同じフィールドを連続した配列に取り出す（SoA 向け）
+        template<typename T, typename V> requires(std::integral<T> || std::floating_point<T>)
+        static void gather(std::span<const V> views, size_t offset, T* out)
+        {
+            for(size_t i = 0; i < views.size(); i++) out[i] = views[i].template field<T>(offset);
+        }
+
+        std::span<const uint8_t> bytes(size_t offset, size_t count) const
+        {
+            if(offset > mBytes.size() || count > mBytes.size() - offset) return {};
+            return mBytes.subspan(offset, count);
+        }
+
+    public:
+        MessageView(uint32_t clientId, TCPServer* server, std::span<const uint8_t> bytes) : mClientId(clientId), mServer(server), mBytes(bytes) {}
+
+        virtual ~MessageView() = default;
+
+        virtual void process() {}
+    };
+
+    template<typename T>
+    concept View = std::is_base_of_v<MessageView, T> && requires { { T::Size } -> std::convertible_to<size_t>; };
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace StardustLib
+{
+    // 共有メモリ上の SPSC バイトリング。TCP と同じくバイトストリームとして扱う
+    // 読み手が待機中と宣言しているときだけ eventfd で起こすので、定常状態ではメッセージごとのシステムコールがない
+    class SharedRing
+    {
+    public:
+        struct alignas(64) Header
+        {
+            alignas(64) std::atomic<uint64_t> head;   // 書き込み位置（書き手のみ更新）
+            alignas(64) std::atomic<uint64_t> tail;   // 読み込み位置（読み手のみ更新）
+            alignas(64) std::atomic<uint32_t> readerWaiting;
+            std::atomic<uint32_t> writerWaiting;
+        };
+
+    private:
+        Header* mHeader = nullptr;
+        uint8_t* mData = nullptr;
+        size_t mCapacity = 0;
+
+    public:
+        SharedRing() = default;
+        SharedRing(void* memory, size_t capacity) : mHeader(static_cast<Header*>(memory)), mData(static_cast<uint8_t*>(memory) + sizeof(Header)), mCapacity(capacity) {}
+
+        static size_t footprint(size_t capacity) noexcept { return sizeof(Header) + capacity; }
+
+        // 位置が壊れている（相手が不正な値を書いた）ときは false。呼び出し側は切断すること
+        bool write(const void* data, size_t size, size_t& outBytes);
+        bool read(void* buffer, size_t size, size_t& outBytes);
+
+        bool empty() const noexcept { return mHeader->head.load(std::memory_order_acquire) == mHeader->tail.load(std::memory_order_relaxed); }
+        bool full() const noexcept { return mHeader->head.load(std::memory_order_relaxed) - mHeader->tail.load(std::memory_order_acquire) == mCapacity; }
+
+        // 待機を宣言した直後に状態を見直して、取りこぼしを防ぐ
+        bool prepareReaderWait() noexcept;
+        bool prepareWriterWait() noexcept;
+        bool takeReaderWaiting() noexcept
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            return mHeader->readerWaiting.load(std::memory_order_relaxed) != 0 && mHeader->readerWaiting.exchange(0) != 0;
+        }
+        bool takeWriterWaiting() noexcept
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            return mHeader->writerWaiting.load(std::memory_order_relaxed) != 0 && mHeader->writerWaiting.exchange(0) != 0;
+        }
+    };
+
+    // memfd 上の双方向リングと 2 つの eventfd（Linux のみ）
+    // サーバー側で作り、Unix ドメインソケット経由で fd をクライアントに渡す
+    class SharedChannel
+    {
+    public:
+        enum class Side { Server, Client };
+
+    private:
+        Side mSide = Side::Server;
+        int mMemoryFd = -1;
+        int mServerEventFd = -1;
+        int mClientEventFd = -1;
+        void* mMemory = nullptr;
+        size_t mMappedSize = 0;
+        size_t mCapacity = 0;
+        SharedRing mToServer;
+        SharedRing mToClient;
+
+        bool map(size_t capacity);
+
+    public:
+        SharedChannel() = default;
+        ~SharedChannel();
+
+        SharedChannel(const SharedChannel&) = delete;
+        SharedChannel& operator=(const SharedChannel&) = delete;
+
+        static std::unique_ptr<SharedChannel> create(size_t capacity);
+        static std::unique_ptr<SharedChannel> attach(int memoryFd, int serverEventFd, int clientEventFd, size_t capacity);
+
+        size_t getCapacity() const { return mCapacity; }
+        int getMemoryFd() const { return mMemoryFd; }
+        int getServerEventFd() const { return mServerEventFd; }
+        int getClientEventFd() const { return mClientEventFd; }
+
+        // 自分が待つ eventfd（poll 用）
+        int getWaitFd() const { return mSide == Side::Server ? mServerEventFd : mClientEventFd; }
+
+        SharedRing& inbound() { return mSide == Side::Server ? mToServer : mToClient; }
+        SharedRing& outbound() { return mSide == Side::Server ? mToClient : mToServer; }
+
+        // 書き込み後・読み込み後に相手が待っていれば起こす
+        void notifyAfterWrite();
+        void notifyAfterRead();
+        void consumeWakeup();
+
+        // poll する前に呼ぶ。すぐ処理できるものがあれば false
+        bool prepareWait(bool wantWrite);
+    };
+}
@@ -2,8 +2,12 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <memory>
 #include <mutex>
+#include <span>
+#include <vector>
 #include <algorithm>
+#include <sys/types.h>
 
 namespace StardustLib
 {
@@ -15,6 +19,13 @@ namespace StardustLib
     
     public:
         enum class Result { Success, WouldBlock, Closed, Error };
+
+        struct Datagram
+        {
+            uint32_t ipAddress = 0; // accept の outIPAddress と同じネットワークバイトオーダー
+            uint16_t port = 0;
+            std::vector<uint8_t> data;
+        };
     
         Socket() : socketFd(-1) {}
         ~Socket() { close(); }
@@ -26,13 +37,26 @@ namespace StardustLib
     
         // Server
         Result create(bool nonBlocking = true, bool noDelay = true);
+        Result enableReusePort(); // bind の前に呼ぶ。同じポートに複数の listen ソケットを開き、カーネルに accept を振り分けさせる
         Result bind(uint16_t port);
         Result listen(int backlog = 16);
+
+        // Unix ドメインソケット（Linux のみ）
+        Result createUnix(bool nonBlocking = true);
+        Result bind(const char* path);
+        Result sendWithFds(const void* data, ssize_t size, std::span<const int> fds);
         Result accept(std::unique_ptr<Socket>& outClient, uint32_t& outIPAddress);
+        Result adopt(int fd, uint32_t& outIPAddress); // io_uring などで accept 済みの fd を引き取る
     
         // Client
         Result send(const void* data, ssize_t size, ssize_t& outBytes);
         Result recv(void* buffer, ssize_t size, ssize_t& outBytes);
+        Result setBusyPoll(int microseconds); // SO_BUSY_POLL（Linux のみ）。空の受信でもこの時間だけドライバーをポーリングする
+
+        // Datagram（Linux では sendmmsg / recvmmsg でまとめて送受信する）
+        Result createDatagram(bool nonBlocking = true);
+        Result sendBatch(std::span<const Datagram> datagrams, size_t& outSent);
+        Result recvBatch(std::span<Datagram> datagrams, size_t capacity, size_t& outReceived);
     
         // Common
         Result close();
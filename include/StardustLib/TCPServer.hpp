@@ -1,9 +1,24 @@
 #pragma once
 
 #include "StardustLib/Socket.hpp"
+#include "StardustLib/Frame.hpp"
+#include "StardustLib/SharedRing.hpp"
+#include "StardustLib/IoUring.hpp"
+#include "StardustLib/TimerWheel.hpp"
+#include "StardustLib/Capture.hpp"
+#include "StardustLib/AdaptiveSpin.hpp"
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <span>
+#include <string>
 #include <vector>
 #include <queue>
+#include <random>
 #include <thread>
+#include <unordered_map>
 #include <atomic>
 
 namespace StardustLib
@@ -11,51 +26,212 @@ namespace StardustLib
     class TCPServer
     {
     public:
+        enum class Priority : uint8_t
+        {
+            Control,
+            High,
+            Normal,
+            Bulk,
+            Unspecified, // ClassifyCallback（未設定なら Normal）で決める
+        };
+        static constexpr size_t PriorityCount = 4;
+
+        enum class Delivery : uint8_t
+        {
+            Reliable,
+            Unreliable,          // UDP。関連付け前や大きすぎる場合は TCP で送る
+            UnreliableSequenced, // UDP。古い順番で届いたものは受信側で捨てる
+            Unspecified,         // ClassifyCallback（未設定なら Reliable）で決める
+        };
+
         struct Packet
         {
             uint32_t clientId;
             std::vector<uint8_t> data;
+            Priority priority = Priority::Unspecified;
+            Delivery delivery = Delivery::Unspecified;
         };
     
         using RecvCallback = std::function<void(const Packet& data)>;
+        using BatchRecvCallback = std::function<void(std::span<const Packet> packets)>;
         using DisconnectCallback = std::function<void(uint32_t clientId)>;
         using ServerIPAddressCallback = std::function<void(uint32_t ipAddress)>;
         using ClientIPAddressCallback = std::function<void(uint32_t ipAddress, uint32_t id)>;
+        using ClassifyCallback = std::function<void(Packet& packet)>; // Unspecified の項目を埋める
+        using TimerId = TimerWheel::TimerId;
+
+        struct ConnectionOptions
+        {
+            bool framed = false;                // Frame.hpp の形式で区切る（false なら受信チャンクをそのまま Packet にする）
+            bool compression = false;           // Hello で圧縮を提案する（framed が必要）
+            size_t compressionThreshold = 256;  // これより小さいフレームは圧縮しない
+            size_t maxFrameSize = 0x1000000;
+            size_t chunkSize = 0x4000;          // framed 接続でレーン間を切り替えられる単位
+            std::array<uint16_t, PriorityCount> laneWeights = { 0, 8, 4, 1 }; // 0 は常に最優先
+            uint16_t datagramPort = 0;          // 0 以外なら UDP を併用する（framed が必要）
+            size_t maxDatagramSize = 1200;      // ヘッダーを除いたメッセージの上限
+            double simulatedLoss = 0.0;         // テスト用。送受信それぞれのデータグラムをこの確率で捨てる
+            std::string unixSocketPath;         // 空でなければ AF_UNIX でも待ち受ける（Linux のみ）
+            size_t sharedRingSize = 0;          // 0 以外なら Unix 接続に共有メモリリングを渡す（framed が必要）
+            bool useIoUring = false;            // 使えれば accept と送受信を io_uring で行う（Linux 6.0 以降。だめなら poll）
+            unsigned uringEntries = 256;
+            unsigned uringBufferCount = 256;    // 受信用の提供バッファ数（2 のべき乗）
+            unsigned uringBufferSize = 0x1000;
+            int listenBacklog = 128;
+            unsigned acceptThreads = 1;         // 2 以上なら Linux ではスレッドごとに SO_REUSEPORT の listen ソケットを開く
+            uint32_t timerTickMs = 10;          // タイマーの分解能
+            uint32_t idleTimeoutMs = 0;         // 0 以外なら、これだけ何も受信しない接続を切る
+            uint32_t keepaliveIntervalMs = 0;   // 0 以外なら、これだけ受信がないときに Ping を送る（framed が必要）
+            uint32_t spinMicroseconds = 0;      // 0 以外なら、transfer と処理スレッドは最大この時間ブロックせずに回ってから眠る
+            int busyPollMicroseconds = 0;       // 0 以外なら接続に SO_BUSY_POLL を設定する（Linux のみ）
+            int transferCpu = -1;               // 0 以上ならそのスレッドをこの CPU に固定する（Linux のみ）
+            int processCpu = -1;
+            bool runToCompletion = false;       // 受信コールバックと schedule() を transfer スレッドで直接呼ぶ（処理スレッドを使わない）
+        };
+
+        struct SpinStats
+        {
+            AdaptiveSpin::Stats transfer;
+            AdaptiveSpin::Stats process;
+        };
+
+        struct CompressionStats
+        {
+            uint64_t rawBytes = 0;
+            uint64_t compressedBytes = 0;
+            uint64_t compressNanoseconds = 0;
+            uint64_t decompressedBytes = 0;
+            uint64_t decompressNanoseconds = 0;
+
+            double ratio() const { return rawBytes ? (double)compressedBytes / rawBytes : 1.0; }
+            double compressNanosecondsPerMB() const { return rawBytes ? compressNanoseconds * 1048576.0 / rawBytes : 0.0; }
+            double decompressNanosecondsPerMB() const { return decompressedBytes ? decompressNanoseconds * 1048576.0 / decompressedBytes : 0.0; }
+        };
     
     private:
         struct Client
         {
             uint32_t id;
+            uint32_t ipAddress = 0;
             std::unique_ptr<Socket> socket;
+            std::unique_ptr<SharedChannel> shared; // あれば送信はリング経由。受信は sharedAttached から
+            bool sharedAttached = false;           // transfer スレッドのみ。クライアントの SharedMemory を受け取った後は socket は切断検知のみ
         
-            std::deque<std::vector<uint8_t>> sendQueue;
+            std::array<std::deque<std::vector<uint8_t>>, PriorityCount> sendQueues;
+            std::array<uint16_t, PriorityCount> laneCredits{};
+            std::vector<uint8_t> sending; // 送信途中のチャンク。送り切るまでレーンを切り替えない
+            size_t sendingOffset = 0;
             std::mutex sendMutex;
+
+            std::vector<uint8_t> recvBuffer;
+            std::array<std::vector<uint8_t>, PriorityCount> partialFrames;
+            std::atomic<bool> compress = false;
+
+            uint64_t datagramToken = 0;
+            std::atomic<uint64_t> datagramEndpoint = 0; // (ipAddress << 16) | port。0 は未関連付け
+            std::atomic<uint32_t> datagramSequence = 0;
+            std::unordered_map<uint32_t, uint32_t> lastDatagramSequence; // メッセージ ID ごと。transfer スレッドのみ
+
+            Client* nextPending = nullptr; // accept スレッドから transfer スレッドへの受け渡し用
+
+            // 以下は transfer スレッドのみ。受信のたびには時刻を書くだけで、タイマーは触らない
+            uint64_t lastActivityTick = 0;
+            TimerId idleTimer = 0;
+            bool expired = false;
         };
     
         uint32_t serverIPAddress;
         uint16_t port;
     
-        std::unique_ptr<Socket> listenSocket;
-        std::vector<std::unique_ptr<Client>> clients;
+        std::vector<std::unique_ptr<Socket>> listenSockets;
+        std::unique_ptr<Socket> unixListenSocket;
+        std::unique_ptr<Socket> datagramSocket;
+        std::unique_ptr<IoUring> uring;
+        std::vector<std::shared_ptr<Client>> clients; // send() は呼び出しの間だけ参照を持つ（消すのは transfer スレッドだけ）
         std::mutex clientsMtx;
         std::atomic<uint32_t> clientCounter = 0;
+        std::atomic<Client*> pendingClients = nullptr; // accept 済みで transfer スレッドがまだ受け取っていないもの（逆順）
     
         RecvCallback recvCallback;
+        BatchRecvCallback batchRecvCallback;
         DisconnectCallback disconnectCallback;
         ServerIPAddressCallback serverIPAddressCallback;
         ClientIPAddressCallback clientIPAddressCallback;
+        ClassifyCallback classifyCallback;
+
+        ConnectionOptions options;
+        std::atomic<uint64_t> statRawBytes = 0;
+        std::atomic<uint64_t> statCompressedBytes = 0;
+        std::atomic<uint64_t> statCompressNs = 0;
+        std::atomic<uint64_t> statDecompressedBytes = 0;
+        std::atomic<uint64_t> statDecompressNs = 0;
+    
+        std::vector<Socket::Datagram> datagramQueue;
+        std::mutex datagramMtx;
+        std::random_device tokenSource; // トークンは UDP の宛先を張り替えられるので、推測できる擬似乱数は使わない
+        std::mutex tokenMtx;            // acceptThreads が複数あると makeClient が並行して呼ばれる
+        std::minstd_rand lossRandom;
+    
+        TimerWheel timers;
+        std::mutex timersMtx;
+        std::chrono::steady_clock::time_point timerEpoch = std::chrono::steady_clock::now();
+        uint64_t transferTick = 0; // transfer スレッドが最後に進めた時刻
+        int transferWakeFd = -1;   // poll の transfer ループを起こす eventfd（Linux のみ）
+    
+        std::unique_ptr<CaptureWriter> capture;
+        std::atomic<bool> capturing = false; // 受信のたびに captureMtx を取らないためのフラグ
+        mutable std::mutex captureMtx;
+    
+        AdaptiveSpin transferSpin;
+        AdaptiveSpin processSpin;
+        std::atomic<bool> queueReady = false; // 処理スレッドがロックを取らずに回るためのフラグ
     
-        std::queue<Packet> packetQueue;
+        std::vector<Packet> packetQueue;
+        std::vector<std::function<void()>> taskQueue; // 期限が来た schedule() のコールバック
         std::mutex queueMtx;
         std::condition_variable queueCv;
     
-        std::jthread acceptThread;
+        std::vector<std::jthread> acceptThreads;
         std::jthread transferThread;
         std::jthread processThread;
     
-        void runAcceptLoop(std::stop_token token, int timeoutMs = 100);
+        void runAcceptLoop(std::stop_token token, std::vector<Socket*> listeners, int timeoutMs = 100);
         void runTransferLoop(std::stop_token token, int timeoutMs = 100);
+        void runUringLoop(std::stop_token token, int timeoutMs = 100);
         void runProcessLoop(std::stop_token token);
+
+        void encodeFrames(const Client& client, uint8_t flags, std::span<const uint8_t> payload, Priority priority, std::vector<std::vector<uint8_t>>& out);
+        bool onReceived(Client& client, const uint8_t* data, size_t size, bool fromShared);
+        bool decodeFrame(Client& client, uint8_t flags, std::span<const uint8_t> payload, std::vector<Packet>& out);
+        void pushPackets(std::vector<Packet>& packets);
+        void deliverPackets(std::span<const Packet> packets);
+        void queueControl(Client& client, std::span<const uint8_t> payload);
+
+        bool hasPendingSend(Client& client);
+        bool selectNextChunk(Client& client);
+        bool flushSend(Client& client);
+        Socket::Result transportSend(Client& client, const uint8_t* data, size_t size, ssize_t& outBytes);
+        bool receiveShared(Client& client, std::vector<uint8_t>& buf);
+
+        Socket::Result acceptClient(Socket& listener, bool local);
+        std::unique_ptr<Client> makeClient(std::unique_ptr<Socket> socket, uint32_t ipAddress, bool local);
+        Client* addClient(std::unique_ptr<Client> client);
+        void adoptPendingClients();
+
+        uint64_t currentTick() const;
+        int timerTimeout(int timeoutMs);
+        void runTimers();
+        void watchIdle(Client& client);
+        void onIdleCheck(Client& client);
+        void unwatchIdle(Client& client);
+        void wakeTransfer();
+        bool offerSharedMemory(Client& client);
+
+        std::shared_ptr<Client> findClient(uint32_t clientId);
+        bool sendDatagram(Client& client, const Packet& packet);
+        void receiveDatagrams();
+        void flushDatagrams();
+        bool simulateLoss();
     
         bool initializeServerIPAddress();
         void finalizeServerIPAddress();
@@ -73,10 +249,26 @@ namespace StardustLib
         void stop();
     
         bool send(Packet packet);
+
+        CompressionStats getCompressionStats() const;
+        SpinStats getSpinStats() const;
+        bool isUsingIoUring() const { return uring != nullptr; }
+
+        // 以後に受信したメッセージを path に記録する（既存のファイルは上書き）。MessageServer::replay で再生できる
+        bool startCapture(const std::string& path);
+        Capture::Stats stopCapture();
+        Capture::Stats getCaptureStats() const;
+
+        // after 後に処理スレッド（受信コールバックと同じスレッド）で fn を呼ぶ。どのスレッドからでも呼べる
+        TimerId schedule(std::chrono::milliseconds after, std::function<void()> fn);
+        bool cancel(TimerId id);
     
         void setRecvCallback(RecvCallback cb) { recvCallback = cb; }
+        void setBatchRecvCallback(BatchRecvCallback cb) { batchRecvCallback = std::move(cb); }
         void setDisconnectCallback(DisconnectCallback cb) { disconnectCallback = std::move(cb); }
         void setServerIPAddressCallback(ServerIPAddressCallback cb) { serverIPAddressCallback = std::move(cb); }
         void setClientIPAddressCallback(ClientIPAddressCallback cb) { clientIPAddressCallback = std::move(cb); }
+        void setClassifyCallback(ClassifyCallback cb) { classifyCallback = std::move(cb); }
+        void setConnectionOptions(ConnectionOptions opts) { options = opts; }
     };
 }
\ No newline at end of file
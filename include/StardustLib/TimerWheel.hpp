@@ -0,0 +1,65 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace StardustLib
+{
+    // 階層タイマーホイール（64 スロット × 4 段）。登録・取り消し・1 tick の前進はいずれも O(1)
+    // 時刻は呼び出し側が決める tick 単位。スレッドセーフではない
+    class TimerWheel
+    {
+    public:
+        using Callback = std::function<void()>;
+        using TimerId = uint64_t; // 0 は無効
+
+        static constexpr size_t SlotBits = 6;
+        static constexpr size_t SlotCount = (size_t)1 << SlotBits;
+        static constexpr size_t LevelCount = 4;
+        static constexpr uint64_t MaxDelay = ((uint64_t)1 << (SlotBits * LevelCount)) - 1;
+
+    private:
+        static constexpr uint32_t Invalid = UINT32_MAX;
+
+        struct Node
+        {
+            Callback callback;
+            uint64_t expiry = 0;
+            uint32_t generation = 1;
+            uint32_t prev = Invalid;
+            uint32_t next = Invalid;
+            uint16_t bucket = 0; // level * SlotCount + slot
+            bool active = false;
+        };
+
+        std::vector<Node> nodes;
+        std::vector<uint32_t> freeNodes;
+        std::array<uint32_t, SlotCount * LevelCount> buckets;
+        std::array<uint64_t, LevelCount> occupied{}; // 空でないスロットのビットマップ
+        uint64_t current = 0;
+        size_t count = 0;
+
+        void link(uint32_t index);
+        void unlink(uint32_t index);
+        void cascade(size_t level);
+
+    public:
+        explicit TimerWheel(uint64_t now = 0);
+
+        uint64_t now() const { return current; }
+        size_t size() const { return count; }
+
+        // delay が 0 でも次の advance まで待つ。MaxDelay を超えるものは上の段で待たせて入れ直す
+        TimerId schedule(uint64_t delay, Callback callback);
+        bool cancel(TimerId id);
+
+        // now まで進めて、期限が来たコールバックを登録順に関係なく out に移す
+        void advance(uint64_t now, std::vector<Callback>& out);
+
+        // 次に何かが起きうるまでの tick 数（何もなければ UINT64_MAX）。poll のタイムアウト用
+        uint64_t ticksUntilNext() const;
+    };
+}
@@ -0,0 +1,292 @@
+#include "StardustLib/Capture.hpp"
+#include "StardustLib/Buffer.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace StardustLib
+{
+    namespace
+    {
+        // 足りなくなったらこの単位でファイルを伸ばして mmap し直す
+        constexpr size_t MapGrowSize = 0x4000000;
+        // これだけ溜まったら周期を待たずに書き出す
+        constexpr size_t FlushThreshold = 0x100000;
+
+        template<typename T>
+        void putBigEndian(uint8_t* dst, T value)
+        {
+            T valueBE = toBigEndian(value);
+            std::memcpy(dst, &valueBE, sizeof(valueBE));
+        }
+
+        template<typename T>
+        T getBigEndian(const uint8_t* src)
+        {
+            T value;
+            std::memcpy(&value, src, sizeof(value));
+            return fromBigEndian(value);
+        }
+    }
+
+    bool CaptureWriter::open(const std::string& path, size_t maxPending)
+    {
+        close();
+
+#ifdef __linux__
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(fd < 0) return false;
+#else
+        file = std::fopen(path.c_str(), "wb");
+        if(!file) return false;
+#endif
+
+        uint8_t header[Capture::FileHeaderSize];
+        putBigEndian(header, Capture::Magic);
+        putBigEndian(header + 4, Capture::Version);
+        if(!writeOut(header))
+        {
+            close();
+            return false;
+        }
+
+        maxPendingBytes = maxPending;
+        startTime = std::chrono::steady_clock::now();
+        statRecords = 0;
+        statBytes = Capture::FileHeaderSize;
+        statDropped = 0;
+        failed = false;
+
+        writerThread = std::jthread([this](std::stop_token token)
+        {
+            runWriterLoop(token);
+        });
+        return true;
+    }
+
+    void CaptureWriter::close()
+    {
+        if(writerThread.joinable())
+        {
+            writerThread.request_stop();
+            {
+                std::lock_guard<std::mutex> lock(pendingMtx);
+                pendingCv.notify_all();
+            }
+            writerThread.join();
+        }
+
+        // 止まる直前に積まれた分
+        if(!pending.empty())
+        {
+            if(!failed && !writeOut(pending)) failed = true;
+            pending.clear();
+        }
+
+        // 途中で欠けたファイルを完全な記録として再生させないように Magic を消す
+        const uint8_t invalidMagic[sizeof(Capture::Magic)] = {};
+#ifdef __linux__
+        if(mapped) munmap(mapped, mappedSize);
+        if(fd >= 0)
+        {
+            if(failed)
+            {
+                ssize_t ret = pwrite(fd, invalidMagic, sizeof(invalidMagic), 0);
+                (void)ret;
+            }
+
+            // 伸ばしすぎた分を切り詰める
+            int ret = ftruncate(fd, written);
+            (void)ret;
+            ::close(fd);
+        }
+#endif
+        if(file)
+        {
+            if(failed && std::fseek(file, 0, SEEK_SET) == 0) std::fwrite(invalidMagic, 1, sizeof(invalidMagic), file);
+            std::fclose(file);
+        }
+
+        mapped = nullptr;
+        mappedSize = 0;
+        written = 0;
+        fd = -1;
+        file = nullptr;
+    }
+
+    bool CaptureWriter::writeOut(std::span<const uint8_t> data)
+    {
+#ifdef __linux__
+        if(fd < 0) return false;
+        if(written + data.size() > mappedSize)
+        {
+            size_t newSize = std::max(mappedSize + MapGrowSize, written + data.size());
+            if(mapped) munmap(mapped, mappedSize);
+            mapped = nullptr;
+            mappedSize = 0;
+            if(ftruncate(fd, newSize) < 0) return false;
+
+            void* memory = mmap(nullptr, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if(memory == MAP_FAILED) return false;
+            mapped = static_cast<uint8_t*>(memory);
+            mappedSize = newSize;
+        }
+        std::memcpy(mapped + written, data.data(), data.size());
+        written += data.size();
+        return true;
+#else
+        if(!file) return false;
+        if(std::fwrite(data.data(), 1, data.size(), file) != data.size()) return false;
+        written += data.size();
+        return true;
+#endif
+    }
+
+    void CaptureWriter::runWriterLoop(std::stop_token token)
+    {
+        std::vector<uint8_t> batch;
+
+        while(!token.stop_requested())
+        {
+            {
+                std::unique_lock<std::mutex> lock(pendingMtx);
+                pendingCv.wait_for(lock, std::chrono::milliseconds(50), [this, &token]
+                {
+                    return pending.size() >= FlushThreshold || token.stop_requested();
+                });
+
+                // 受信側は空になった側のバッファにそのまま詰め続けられる
+                batch.clear();
+                batch.swap(pending);
+            }
+
+            if(!batch.empty() && !writeOut(batch))
+            {
+                // ディスクが一杯など。以後の append は捨てられ、TCPServer が hasFailed で気付く
+                failed = true;
+                return;
+            }
+        }
+    }
+
+    void CaptureWriter::append(uint32_t clientId, uint8_t delivery, std::span<const uint8_t> data)
+    {
+        uint64_t timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+
+        uint8_t header[Capture::RecordHeaderSize];
+        putBigEndian(header, (uint32_t)data.size());
+        putBigEndian(header + 4, clientId);
+        putBigEndian(header + 8, timestamp);
+        header[16] = delivery;
+
+        size_t recordSize = sizeof(header) + data.size();
+        bool notify;
+        {
+            std::lock_guard<std::mutex> lock(pendingMtx);
+            if(failed.load(std::memory_order_relaxed) || pending.size() + recordSize > maxPendingBytes)
+            {
+                statDropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+
+            pending.insert(pending.end(), header, header + sizeof(header));
+            pending.insert(pending.end(), data.begin(), data.end());
+            notify = pending.size() >= FlushThreshold;
+        }
+        if(notify) pendingCv.notify_one();
+
+        statRecords.fetch_add(1, std::memory_order_relaxed);
+        statBytes.fetch_add(recordSize, std::memory_order_relaxed);
+    }
+
+    Capture::Stats CaptureWriter::getStats() const
+    {
+        Capture::Stats stats;
+        stats.records = statRecords.load(std::memory_order_relaxed);
+        stats.bytes = statBytes.load(std::memory_order_relaxed);
+        stats.dropped = statDropped.load(std::memory_order_relaxed);
+        stats.failed = failed.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    void CaptureReader::release()
+    {
+#ifdef __linux__
+        if(mapped) munmap(mapped, size);
+#endif
+        mapped = nullptr;
+        contents.clear();
+        data = nullptr;
+        size = 0;
+        position = 0;
+    }
+
+    bool CaptureReader::open(const std::string& path)
+    {
+        release();
+
+#ifdef __linux__
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd < 0) return false;
+
+        struct stat st;
+        if(fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            void* memory = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(memory != MAP_FAILED)
+            {
+                mapped = memory;
+                data = static_cast<const uint8_t*>(memory);
+                size = st.st_size;
+                // 先頭から順に読むだけなので先読みさせる
+                madvise(memory, size, MADV_SEQUENTIAL);
+            }
+        }
+        ::close(fd);
+#else
+        std::FILE* file = std::fopen(path.c_str(), "rb");
+        if(!file) return false;
+
+        uint8_t chunk[0x10000];
+        size_t n;
+        while((n = std::fread(chunk, 1, sizeof(chunk), file)) > 0) contents.insert(contents.end(), chunk, chunk + n);
+        std::fclose(file);
+        data = contents.data();
+        size = contents.size();
+#endif
+
+        if(size < Capture::FileHeaderSize
+            || getBigEndian<uint32_t>(data) != Capture::Magic
+            || getBigEndian<uint32_t>(data + 4) != Capture::Version)
+        {
+            release();
+            return false;
+        }
+
+        position = Capture::FileHeaderSize;
+        return true;
+    }
+
+    bool CaptureReader::next(Capture::Record& out)
+    {
+        if(size - position < Capture::RecordHeaderSize) return false;
+
+        const uint8_t* header = data + position;
+        uint32_t length = getBigEndian<uint32_t>(header);
+        if(size - position - Capture::RecordHeaderSize < length) return false;
+
+        out.clientId = getBigEndian<uint32_t>(header + 4);
+        out.timestampNs = getBigEndian<uint64_t>(header + 8);
+        out.delivery = header[16];
+        out.data = std::span<const uint8_t>(header + Capture::RecordHeaderSize, length);
+        position += Capture::RecordHeaderSize + length;
+        return true;
+    }
+}
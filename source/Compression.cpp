@@ -0,0 +1,198 @@
+#include "StardustLib/Compression.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace StardustLib
+{
+    namespace
+    {
+        constexpr size_t MinMatch = 4;
+        constexpr size_t LastLiterals = 5;
+        constexpr size_t MatchFindLimit = 12;
+        constexpr size_t MaxOffset = 0xFFFF;
+        constexpr int HashLog = 12;
+
+        uint32_t read32(const uint8_t* p)
+        {
+            uint32_t v;
+            std::memcpy(&v, p, sizeof(v));
+            return v;
+        }
+
+        uint32_t hash(uint32_t sequence)
+        {
+            return (sequence * 2654435761u) >> (32 - HashLog);
+        }
+
+        uint8_t* writeLength(uint8_t* op, size_t length)
+        {
+            while(length >= 255)
+            {
+                *op++ = 255;
+                length -= 255;
+            }
+            *op++ = (uint8_t)length;
+            return op;
+        }
+
+        uint8_t* writeSequence(uint8_t* op, const uint8_t* literals, size_t literalLength, size_t offset, size_t matchLength)
+        {
+            uint8_t* token = op++;
+            *token = (uint8_t)((literalLength >= 15 ? 15 : literalLength) << 4);
+            if(literalLength >= 15) op = writeLength(op, literalLength - 15);
+
+            if(literalLength > 0) std::memcpy(op, literals, literalLength);
+            op += literalLength;
+
+            // 最後のシーケンスはリテラルのみ
+            if(matchLength == 0) return op;
+
+            *op++ = (uint8_t)(offset & 0xFF);
+            *op++ = (uint8_t)(offset >> 8);
+
+            size_t code = matchLength - MinMatch;
+            *token |= (uint8_t)(code >= 15 ? 15 : code);
+            if(code >= 15) op = writeLength(op, code - 15);
+
+            return op;
+        }
+    }
+
+    bool Compression::compress(std::span<const uint8_t> src, std::vector<uint8_t>& dst)
+    {
+        const uint8_t* base = src.data();
+        const size_t size = src.size();
+
+        const size_t start = dst.size();
+        dst.resize(start + compressBound(size));
+        uint8_t* const out = dst.data() + start;
+        uint8_t* op = out;
+
+        size_t anchor = 0;
+
+        if(size > MatchFindLimit)
+        {
+            // 16KB あるので Wii U の小さなスレッドスタックには置かない。send() は任意のスレッドから呼ばれるのでスレッドごとに持つ
+            thread_local std::vector<uint32_t> table(1 << HashLog);
+            std::fill(table.begin(), table.end(), 0);
+            const size_t matchLimit = size - LastLiterals;
+            const size_t findLimit = size - MatchFindLimit;
+
+            size_t ip = 0;
+            unsigned misses = 0;
+            while(ip < findLimit)
+            {
+                uint32_t sequence = read32(base + ip);
+                uint32_t h = hash(sequence);
+                size_t candidate = table[h];
+                table[h] = (uint32_t)ip;
+
+                if(candidate >= ip || ip - candidate > MaxOffset || read32(base + candidate) != sequence)
+                {
+                    // 一致しない区間が続くほど歩幅を広げる
+                    ip += 1 + (misses++ >> 6);
+                    continue;
+                }
+                misses = 0;
+
+                while(ip > anchor && candidate > 0 && base[ip - 1] == base[candidate - 1])
+                {
+                    ip--;
+                    candidate--;
+                }
+
+                size_t length = MinMatch;
+                while(ip + length < matchLimit && base[candidate + length] == base[ip + length]) length++;
+
+                op = writeSequence(op, base + anchor, ip - anchor, ip - candidate, length);
+
+                ip += length;
+                anchor = ip;
+
+                if(ip < findLimit) table[hash(read32(base + ip - 2))] = (uint32_t)(ip - 2);
+            }
+        }
+
+        op = writeSequence(op, base + anchor, size - anchor, 0, 0);
+
+        size_t written = op - out;
+        if(written >= size)
+        {
+            dst.resize(start);
+            return false;
+        }
+
+        dst.resize(start + written);
+        return true;
+    }
+
+    bool Compression::decompress(std::span<const uint8_t> src, size_t rawSize, std::vector<uint8_t>& dst)
+    {
+        const size_t start = dst.size();
+        dst.resize(start + rawSize);
+        uint8_t* const out = dst.data() + start;
+
+        const uint8_t* ip = src.data();
+        const uint8_t* const end = ip + src.size();
+        size_t op = 0;
+
+        auto fail = [&]
+        {
+            dst.resize(start);
+            return false;
+        };
+
+        auto readLength = [&](size_t& length)
+        {
+            uint8_t b;
+            do
+            {
+                if(ip >= end) return false;
+                b = *ip++;
+                length += b;
+            } while(b == 255);
+            return true;
+        };
+
+        while(ip < end)
+        {
+            uint8_t token = *ip++;
+
+            size_t literalLength = token >> 4;
+            if(literalLength == 15 && !readLength(literalLength)) return fail();
+            if(literalLength > (size_t)(end - ip) || literalLength > rawSize - op) return fail();
+
+            if(literalLength > 0) std::memcpy(out + op, ip, literalLength);
+            ip += literalLength;
+            op += literalLength;
+
+            if(ip == end) break;
+
+            if(end - ip < 2) return fail();
+            size_t offset = ip[0] | (ip[1] << 8);
+            ip += 2;
+            if(offset == 0 || offset > op) return fail();
+
+            size_t matchLength = token & 0x0F;
+            if(matchLength == 15 && !readLength(matchLength)) return fail();
+            matchLength += MinMatch;
+            if(matchLength > rawSize - op) return fail();
+
+            const uint8_t* match = out + op - offset;
+            if(offset >= matchLength)
+            {
+                std::memcpy(out + op, match, matchLength);
+            }
+            else
+            {
+                // 重なりのあるコピーは 1 バイトずつ
+                for(size_t i = 0; i < matchLength; i++) out[op + i] = match[i];
+            }
+            op += matchLength;
+        }
+
+        if(op != rawSize) return fail();
+        return true;
+    }
+}
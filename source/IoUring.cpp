@@ -0,0 +1,356 @@
+#include "StardustLib/IoUring.hpp"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define STARDUST_IO_URING 1
+#endif
+
+#ifdef STARDUST_IO_URING
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace StardustLib
+{
+#ifdef STARDUST_IO_URING
+    namespace
+    {
+        unsigned loadAcquire(unsigned* p)
+        {
+            return std::atomic_ref<unsigned>(*p).load(std::memory_order_acquire);
+        }
+
+        void storeRelease(unsigned* p, unsigned value)
+        {
+            std::atomic_ref<unsigned>(*p).store(value, std::memory_order_release);
+        }
+
+        int setup(unsigned entries, io_uring_params& params)
+        {
+            return (int)syscall(__NR_io_uring_setup, entries, &params);
+        }
+    }
+
+    bool IoUring::init(unsigned entries, unsigned count, unsigned size)
+    {
+        if(count == 0 || (count & (count - 1)) != 0 || count > 0x8000) return false;
+
+        io_uring_params params{};
+        params.flags = IORING_SETUP_COOP_TASKRUN;
+        ringFd = setup(entries, params);
+        if(ringFd < 0)
+        {
+            // 古いカーネルは COOP_TASKRUN を知らない
+            params = {};
+            ringFd = setup(entries, params);
+        }
+        if(ringFd < 0) return false;
+
+        if(!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG))
+        {
+            release();
+            return false;
+        }
+
+        size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        ringMemorySize = sqSize > cqSize ? sqSize : cqSize;
+        ringMemory = mmap(nullptr, ringMemorySize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        if(ringMemory == MAP_FAILED)
+        {
+            ringMemory = nullptr;
+            release();
+            return false;
+        }
+
+        sqeMemorySize = params.sq_entries * sizeof(io_uring_sqe);
+        sqeMemory = mmap(nullptr, sqeMemorySize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if(sqeMemory == MAP_FAILED)
+        {
+            sqeMemory = nullptr;
+            release();
+            return false;
+        }
+
+        auto* base = static_cast<uint8_t*>(ringMemory);
+        sqHead = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+        sqTail = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+        sqArray = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+        sqMask = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+        sqEntries = params.sq_entries;
+        sqeTail = *sqTail;
+
+        cqHead = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+        cqMask = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+        cqes = base + params.cq_off.cqes;
+
+        // 受信用の提供バッファリング
+        bufferCount = count;
+        bufferSize = size;
+        bufferRingSize = count * sizeof(io_uring_buf);
+        bufferRing = mmap(nullptr, bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(bufferRing == MAP_FAILED)
+        {
+            bufferRing = nullptr;
+            release();
+            return false;
+        }
+
+        io_uring_buf_reg reg{};
+        reg.ring_addr = (uint64_t)(uintptr_t)bufferRing;
+        reg.ring_entries = count;
+        reg.bgid = 0;
+        if(syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        {
+            release();
+            return false;
+        }
+
+        bufferMemory.resize((size_t)count * size);
+        for(unsigned i = 0; i < count; i++) addBuffer((uint16_t)i);
+
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(wakeFd < 0 || !probeMultishotRecv())
+        {
+            release();
+            return false;
+        }
+
+        return true;
+    }
+
+    void IoUring::release()
+    {
+        if(bufferRing) munmap(bufferRing, bufferRingSize);
+        if(sqeMemory) munmap(sqeMemory, sqeMemorySize);
+        if(ringMemory) munmap(ringMemory, ringMemorySize);
+        if(ringFd >= 0) close(ringFd);
+        if(wakeFd >= 0) close(wakeFd);
+        bufferRing = nullptr;
+        sqeMemory = nullptr;
+        ringMemory = nullptr;
+        ringFd = -1;
+        wakeFd = -1;
+    }
+
+    bool IoUring::probeMultishotRecv()
+    {
+        // multishot recv（6.0 以降）は opcode の probe では分からないので実際に試す
+        int sv[2];
+        if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) return false;
+
+        prepareRecvMultishot(sv[0], 0);
+        const uint8_t byte = 0;
+        ssize_t written = ::write(sv[1], &byte, 1);
+        close(sv[1]);
+
+        bool supported = false;
+        bool finished = written != 1;
+        std::vector<Completion> completions;
+        for(int i = 0; i < 10 && !finished; i++)
+        {
+            submitAndWait(100);
+            completions.clear();
+            reap(completions);
+            for(const auto& c : completions)
+            {
+                if(c.result == 1 && hasBuffer(c.flags))
+                {
+                    supported = hasMore(c.flags);
+                    recycleBuffer(c.flags);
+                }
+                if(!hasMore(c.flags)) finished = true;
+            }
+        }
+
+        close(sv[0]);
+        return supported && finished;
+    }
+
+    void* IoUring::getSqe()
+    {
+        if(sqeTail - loadAcquire(sqHead) >= sqEntries)
+        {
+            enter(sqeTail - loadAcquire(sqHead), false, 0);
+            if(sqeTail - loadAcquire(sqHead) >= sqEntries) return nullptr;
+        }
+
+        unsigned index = sqeTail & sqMask;
+        auto* sqe = static_cast<io_uring_sqe*>(sqeMemory) + index;
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqArray[index] = index;
+        sqeTail++;
+        return sqe;
+    }
+
+    int IoUring::enter(unsigned toSubmit, bool wait, int timeoutMs)
+    {
+        storeRelease(sqTail, sqeTail);
+
+        __kernel_timespec ts{};
+        ts.tv_sec = timeoutMs / 1000;
+        ts.tv_nsec = (long long)(timeoutMs % 1000) * 1000000;
+
+        io_uring_getevents_arg arg{};
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+
+        unsigned flags = IORING_ENTER_EXT_ARG | (wait ? IORING_ENTER_GETEVENTS : 0);
+        int ret = (int)syscall(__NR_io_uring_enter, ringFd, toSubmit, wait ? 1 : 0, flags, &arg, sizeof(arg));
+        if(ret < 0 && (errno == ETIME || errno == EINTR)) return 0;
+        return ret;
+    }
+
+    bool IoUring::prepareAcceptMultishot(int fd, uint64_t userData)
+    {
+        auto* sqe = static_cast<io_uring_sqe*>(getSqe());
+        if(!sqe) return false;
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data = userData;
+        return true;
+    }
+
+    bool IoUring::prepareRecvMultishot(int fd, uint64_t userData)
+    {
+        auto* sqe = static_cast<io_uring_sqe*>(getSqe());
+        if(!sqe) return false;
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        sqe->user_data = userData;
+        return true;
+    }
+
+    bool IoUring::prepareSend(int fd, const void* data, size_t size, uint64_t userData)
+    {
+        auto* sqe = static_cast<io_uring_sqe*>(getSqe());
+        if(!sqe) return false;
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)data;
+        sqe->len = (uint32_t)size;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = userData;
+        return true;
+    }
+
+    bool IoUring::preparePollMultishot(int fd, uint64_t userData)
+    {
+        auto* sqe = static_cast<io_uring_sqe*>(getSqe());
+        if(!sqe) return false;
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = userData;
+        return true;
+    }
+
+    bool IoUring::prepareCancelFd(int fd, uint64_t userData)
+    {
+        auto* sqe = static_cast<io_uring_sqe*>(getSqe());
+        if(!sqe) return false;
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = userData;
+        return true;
+    }
+
+    int IoUring::submitAndWait(int timeoutMs)
+    {
+        unsigned toSubmit = sqeTail - loadAcquire(sqHead);
+        bool wait = timeoutMs != 0 && loadAcquire(cqTail) == *cqHead;
+        if(toSubmit == 0 && !wait) return 0;
+        return enter(toSubmit, wait, timeoutMs);
+    }
+
+    void IoUring::reap(std::vector<Completion>& out)
+    {
+        unsigned head = *cqHead;
+        unsigned tail = loadAcquire(cqTail);
+        for(; head != tail; head++)
+        {
+            const auto& cqe = static_cast<io_uring_cqe*>(cqes)[head & cqMask];
+            out.push_back({ cqe.user_data, cqe.res, cqe.flags });
+        }
+        storeRelease(cqHead, head);
+    }
+
+    bool IoUring::hasMore(uint32_t flags)
+    {
+        return (flags & IORING_CQE_F_MORE) != 0;
+    }
+
+    bool IoUring::hasBuffer(uint32_t flags)
+    {
+        return (flags & IORING_CQE_F_BUFFER) != 0;
+    }
+
+    void IoUring::addBuffer(uint16_t bufferId)
+    {
+        // C++ では __DECLARE_FLEX_ARRAY の空構造体で bufs がずれるので、io_uring_buf の配列として直接扱う
+        auto* ring = static_cast<io_uring_buf_ring*>(bufferRing);
+        auto& buf = static_cast<io_uring_buf*>(bufferRing)[bufferTail & (bufferCount - 1)];
+        buf.addr = (uint64_t)(uintptr_t)(bufferMemory.data() + (size_t)bufferId * bufferSize);
+        buf.len = bufferSize;
+        buf.bid = bufferId;
+        bufferTail++;
+        std::atomic_ref<uint16_t>(ring->tail).store(bufferTail, std::memory_order_release);
+    }
+
+    std::span<const uint8_t> IoUring::buffer(uint32_t flags, int32_t length) const
+    {
+        uint16_t bufferId = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+        return std::span<const uint8_t>(bufferMemory.data() + (size_t)bufferId * bufferSize, length);
+    }
+
+    void IoUring::recycleBuffer(uint32_t flags)
+    {
+        addBuffer((uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT));
+    }
+
+    void IoUring::wake()
+    {
+        uint64_t one = 1;
+        ssize_t ret = ::write(wakeFd, &one, sizeof(one));
+        (void)ret;
+    }
+
+    void IoUring::consumeWake()
+    {
+        uint64_t count;
+        ssize_t ret = ::read(wakeFd, &count, sizeof(count));
+        (void)ret;
+    }
+#else
+    bool IoUring::init(unsigned, unsigned, unsigned) { return false; }
+    void IoUring::release() {}
+    bool IoUring::prepareAcceptMultishot(int, uint64_t) { return false; }
+    bool IoUring::prepareRecvMultishot(int, uint64_t) { return false; }
+    bool IoUring::prepareSend(int, const void*, size_t, uint64_t) { return false; }
+    bool IoUring::preparePollMultishot(int, uint64_t) { return false; }
+    bool IoUring::prepareCancelFd(int, uint64_t) { return false; }
+    int IoUring::submitAndWait(int) { return -1; }
+    void IoUring::reap(std::vector<Completion>&) {}
+    bool IoUring::hasMore(uint32_t) { return false; }
+    bool IoUring::hasBuffer(uint32_t) { return false; }
+    std::span<const uint8_t> IoUring::buffer(uint32_t, int32_t) const { return {}; }
+    void IoUring::recycleBuffer(uint32_t) {}
+    void IoUring::wake() {}
+    void IoUring::consumeWake() {}
+#endif
+}
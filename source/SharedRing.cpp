@@ -0,0 +1,194 @@
+#include "StardustLib/SharedRing.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace StardustLib
+{
+    bool SharedRing::write(const void* data, size_t size, size_t& outBytes)
+    {
+        outBytes = 0;
+        uint64_t head = mHeader->head.load(std::memory_order_relaxed);
+        uint64_t tail = mHeader->tail.load(std::memory_order_acquire);
+        // どちらの位置も相手が書き換えられるので、読み込んだ値で範囲を確かめてからコピーする
+        if(head - tail > mCapacity) return false;
+
+        size_t count = std::min(size, mCapacity - (size_t)(head - tail));
+        if(count == 0) return true;
+
+        size_t offset = head % mCapacity;
+        size_t first = std::min(count, mCapacity - offset);
+        std::memcpy(mData + offset, data, first);
+        std::memcpy(mData, static_cast<const uint8_t*>(data) + first, count - first);
+
+        mHeader->head.store(head + count, std::memory_order_release);
+        outBytes = count;
+        return true;
+    }
+
+    bool SharedRing::read(void* buffer, size_t size, size_t& outBytes)
+    {
+        outBytes = 0;
+        uint64_t tail = mHeader->tail.load(std::memory_order_relaxed);
+        uint64_t head = mHeader->head.load(std::memory_order_acquire);
+        if(head - tail > mCapacity) return false;
+
+        size_t count = std::min(size, (size_t)(head - tail));
+        if(count == 0) return true;
+
+        size_t offset = tail % mCapacity;
+        size_t first = std::min(count, mCapacity - offset);
+        std::memcpy(buffer, mData + offset, first);
+        std::memcpy(static_cast<uint8_t*>(buffer) + first, mData, count - first);
+
+        mHeader->tail.store(tail + count, std::memory_order_release);
+        outBytes = count;
+        return true;
+    }
+
+    bool SharedRing::prepareReaderWait() noexcept
+    {
+        mHeader->readerWaiting.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(!empty())
+        {
+            mHeader->readerWaiting.store(0, std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+
+    bool SharedRing::prepareWriterWait() noexcept
+    {
+        mHeader->writerWaiting.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(!full())
+        {
+            mHeader->writerWaiting.store(0, std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+
+    SharedChannel::~SharedChannel()
+    {
+#ifdef __linux__
+        if(mMemory) munmap(mMemory, mMappedSize);
+        if(mMemoryFd >= 0) close(mMemoryFd);
+        if(mServerEventFd >= 0) close(mServerEventFd);
+        if(mClientEventFd >= 0) close(mClientEventFd);
+#endif
+    }
+
+    bool SharedChannel::map(size_t capacity)
+    {
+#ifdef __linux__
+        mCapacity = capacity;
+        mMappedSize = SharedRing::footprint(capacity) * 2;
+        void* memory = mmap(nullptr, mMappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, mMemoryFd, 0);
+        if(memory == MAP_FAILED) return false;
+
+        mMemory = memory;
+        mToServer = SharedRing(mMemory, capacity);
+        mToClient = SharedRing(static_cast<uint8_t*>(mMemory) + SharedRing::footprint(capacity), capacity);
+        return true;
+#else
+        (void)capacity;
+        return false;
+#endif
+    }
+
+    std::unique_ptr<SharedChannel> SharedChannel::create(size_t capacity)
+    {
+#ifdef __linux__
+        // 2 本目のヘッダーもキャッシュラインに揃える
+        capacity = (capacity + 63) & ~(size_t)63;
+
+        auto channel = std::make_unique<SharedChannel>();
+        channel->mSide = Side::Server;
+        channel->mMemoryFd = memfd_create("stardust-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if(channel->mMemoryFd < 0) return nullptr;
+        if(ftruncate(channel->mMemoryFd, SharedRing::footprint(capacity) * 2) < 0) return nullptr;
+        // 相手に縮められるとこちらのマッピングへのアクセスが SIGBUS になる
+        if(fcntl(channel->mMemoryFd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) return nullptr;
+        if(!channel->map(capacity)) return nullptr;
+
+        new (channel->mMemory) SharedRing::Header{};
+        new (static_cast<uint8_t*>(channel->mMemory) + SharedRing::footprint(capacity)) SharedRing::Header{};
+
+        channel->mServerEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        channel->mClientEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(channel->mServerEventFd < 0 || channel->mClientEventFd < 0) return nullptr;
+
+        return channel;
+#else
+        (void)capacity;
+        return nullptr;
+#endif
+    }
+
+    std::unique_ptr<SharedChannel> SharedChannel::attach(int memoryFd, int serverEventFd, int clientEventFd, size_t capacity)
+    {
+        auto channel = std::make_unique<SharedChannel>();
+        channel->mSide = Side::Client;
+        channel->mMemoryFd = memoryFd;
+        channel->mServerEventFd = serverEventFd;
+        channel->mClientEventFd = clientEventFd;
+#ifdef __linux__
+        // 申告された容量を信用せず、実際のサイズに収まるかを確かめてから mmap する
+        struct stat st;
+        if(capacity == 0 || fstat(memoryFd, &st) < 0 || (uint64_t)st.st_size < (uint64_t)SharedRing::footprint(capacity) * 2) return nullptr;
+#endif
+        if(!channel->map(capacity)) return nullptr;
+        return channel;
+    }
+
+    void SharedChannel::notifyAfterWrite()
+    {
+#ifdef __linux__
+        if(outbound().takeReaderWaiting())
+        {
+            uint64_t one = 1;
+            ssize_t ret = ::write(mSide == Side::Server ? mClientEventFd : mServerEventFd, &one, sizeof(one));
+            (void)ret;
+        }
+#endif
+    }
+
+    void SharedChannel::notifyAfterRead()
+    {
+#ifdef __linux__
+        if(inbound().takeWriterWaiting())
+        {
+            uint64_t one = 1;
+            ssize_t ret = ::write(mSide == Side::Server ? mClientEventFd : mServerEventFd, &one, sizeof(one));
+            (void)ret;
+        }
+#endif
+    }
+
+    void SharedChannel::consumeWakeup()
+    {
+#ifdef __linux__
+        uint64_t count;
+        ssize_t ret = ::read(getWaitFd(), &count, sizeof(count));
+        (void)ret;
+#endif
+    }
+
+    bool SharedChannel::prepareWait(bool wantWrite)
+    {
+        bool canBlock = inbound().prepareReaderWait();
+        if(wantWrite && !outbound().prepareWriterWait()) canBlock = false;
+        return canBlock;
+    }
+}
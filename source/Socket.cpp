@@ -7,6 +7,12 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <cstring>
+
+#ifdef __linux__
+#include <sys/un.h>
+#include <sys/stat.h>
+#endif
 
 namespace StardustLib
 {
@@ -58,6 +64,17 @@ namespace StardustLib
         return Result::Success;
     }
 
+    Socket::Result Socket::enableReusePort()
+    {
+#ifdef SO_REUSEPORT
+        int opt = 1;
+        if(setsockopt(socketFd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) return Result::Error;
+        return Result::Success;
+#else
+        return Result::Error;
+#endif
+    }
+
     Socket::Result Socket::bind(uint16_t port)
     {
         sockaddr_in addr;
@@ -97,19 +114,154 @@ namespace StardustLib
         return Result::Success;
     }
 
+    Socket::Result Socket::createUnix(bool nonBlocking)
+    {
+#ifdef __linux__
+        socketFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(socketFd < 0)
+        {
+            close();
+            return Result::Error;
+        }
+
+        if(nonBlocking)
+        {
+            int flags = fcntl(socketFd, F_GETFL, 0);
+            if(flags < 0)
+            {
+                close();
+                return Result::Error;
+            }
+            int ret = fcntl(socketFd, F_SETFL, flags | O_NONBLOCK);
+            if(ret < 0)
+            {
+                close();
+                return Result::Error;
+            }
+        }
+
+        return Result::Success;
+#else
+        (void)nonBlocking;
+        return Result::Error;
+#endif
+    }
+
+    Socket::Result Socket::bind(const char* path)
+    {
+#ifdef __linux__
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if(std::strlen(path) >= sizeof(addr.sun_path))
+        {
+            close();
+            return Result::Error;
+        }
+        std::strcpy(addr.sun_path, path);
+
+        // 前回のソケットファイルだけを消す（パスを間違えても普通のファイルは消さない）
+        struct stat st;
+        bool stale = ::lstat(path, &st) == 0;
+        if(stale && !S_ISSOCK(st.st_mode))
+        {
+            close();
+            return Result::Error;
+        }
+
+        int res;
+        {
+            std::lock_guard<std::mutex> bindLock(mutex);
+            if(stale) ::unlink(path);
+            res = ::bind(socketFd, (sockaddr*)&addr, sizeof(addr));
+        }
+
+        if(res < 0)
+        {
+            close();
+            return Result::Error;
+        }
+
+        return Result::Success;
+#else
+        (void)path;
+        return Result::Error;
+#endif
+    }
+
+    Socket::Result Socket::sendWithFds(const void* data, ssize_t size, std::span<const int> fds)
+    {
+#ifdef __linux__
+        if(socketFd < 0 || fds.empty() || fds.size() > 8) return Result::Error;
+
+        iovec iov{};
+        iov.iov_base = const_cast<void*>(data);
+        iov.iov_len = size;
+
+        alignas(cmsghdr) uint8_t control[CMSG_SPACE(sizeof(int) * 8)] = {};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+
+        ssize_t sent;
+        {
+            std::lock_guard<std::mutex> sendLock(mutex);
+            sent = ::sendmsg(socketFd, &msg, MSG_NOSIGNAL);
+        }
+
+        // fd を載せたメッセージは分割させない
+        if(sent == size) return Result::Success;
+        if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return Result::WouldBlock;
+        return Result::Error;
+#else
+        (void)data;
+        (void)size;
+        (void)fds;
+        return Result::Error;
+#endif
+    }
+
     Socket::Result Socket::accept(std::unique_ptr<Socket>& outClient, uint32_t& outIPAddresss)
     {
         int clientFd;
-        sockaddr_in addr;
+        union
+        {
+            sockaddr_in in;
+#ifdef __linux__
+            sockaddr_un un;
+#endif
+        } addr;
         socklen_t len = sizeof(addr);
         {
             std::lock_guard<std::mutex> acceptLock(mutex);
+            // 送信は WouldBlock まで書き込むので、受け取った接続は必ずノンブロッキングにする
+#ifdef __linux__
+            clientFd = ::accept4(socketFd, (sockaddr*)&addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
             clientFd = ::accept(socketFd, (sockaddr*)&addr, &len);
+            if(clientFd >= 0)
+            {
+                int flags = fcntl(clientFd, F_GETFL, 0);
+                if(flags < 0 || fcntl(clientFd, F_SETFL, flags | O_NONBLOCK) < 0)
+                {
+                    ::close(clientFd);
+                    return Result::Error;
+                }
+            }
+#endif
         }
 
         if(clientFd >= 0)
         {
-            outIPAddresss = addr.sin_addr.s_addr;
+            // Unix ドメインなど IPv4 以外は 0
+            outIPAddresss = addr.in.sin_family == AF_INET ? addr.in.sin_addr.s_addr : 0;
             outClient = std::make_unique<Socket>();
             outClient->socketFd = clientFd;
             return Result::Success;
@@ -124,6 +276,21 @@ namespace StardustLib
         }
     }
 
+    Socket::Result Socket::adopt(int fd, uint32_t& outIPAddress)
+    {
+        if(fd < 0) return Result::Error;
+        close();
+
+        sockaddr_in addr{};
+        socklen_t len = sizeof(addr);
+        // Unix ドメインなど IPv4 以外は 0（accept と同じ）
+        if(getpeername(fd, (sockaddr*)&addr, &len) == 0 && len >= sizeof(addr) && addr.sin_family == AF_INET) outIPAddress = addr.sin_addr.s_addr;
+        else outIPAddress = 0;
+
+        socketFd = fd;
+        return Result::Success;
+    }
+
     Socket::Result Socket::send(const void* data, ssize_t size, ssize_t& outBytes)
     {
         if(socketFd < 0) return Result::Error;
@@ -186,6 +353,176 @@ namespace StardustLib
         }
     }
 
+    Socket::Result Socket::setBusyPoll(int microseconds)
+    {
+#ifdef SO_BUSY_POLL
+        if(setsockopt(socketFd, SOL_SOCKET, SO_BUSY_POLL, &microseconds, sizeof(microseconds)) < 0) return Result::Error;
+        return Result::Success;
+#else
+        (void)microseconds;
+        return Result::Error;
+#endif
+    }
+
+    Socket::Result Socket::createDatagram(bool nonBlocking)
+    {
+        socketFd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if(socketFd < 0)
+        {
+            close();
+            return Result::Error;
+        }
+
+        int ret;
+
+        int opt = 1;
+        ret = setsockopt(socketFd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if(ret < 0)
+        {
+            close();
+            return Result::Error;
+        }
+
+        if(nonBlocking)
+        {
+            int flags = fcntl(socketFd, F_GETFL, 0);
+            if(flags < 0)
+            {
+                close();
+                return Result::Error;
+            }
+            ret = fcntl(socketFd, F_SETFL, flags | O_NONBLOCK);
+            if(ret < 0)
+            {
+                close();
+                return Result::Error;
+            }
+        }
+
+        return Result::Success;
+    }
+
+    Socket::Result Socket::sendBatch(std::span<const Datagram> datagrams, size_t& outSent)
+    {
+        outSent = 0;
+        if(socketFd < 0) return Result::Error;
+        if(datagrams.empty()) return Result::Success;
+
+        std::vector<sockaddr_in> addrs(datagrams.size());
+        for(size_t i = 0; i < datagrams.size(); i++)
+        {
+            addrs[i].sin_family = AF_INET;
+            addrs[i].sin_addr.s_addr = datagrams[i].ipAddress;
+            addrs[i].sin_port = htons(datagrams[i].port);
+        }
+
+        std::lock_guard<std::mutex> sendLock(mutex);
+#if defined(__linux__)
+        std::vector<iovec> iovs(datagrams.size());
+        std::vector<mmsghdr> msgs(datagrams.size());
+        for(size_t i = 0; i < datagrams.size(); i++)
+        {
+            iovs[i].iov_base = const_cast<uint8_t*>(datagrams[i].data.data());
+            iovs[i].iov_len = datagrams[i].data.size();
+            msgs[i] = {};
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        while(outSent < datagrams.size())
+        {
+            int sent = ::sendmmsg(socketFd, msgs.data() + outSent, datagrams.size() - outSent, 0);
+            if(sent < 0)
+            {
+                if(errno == EINTR) continue;
+                if(errno == EAGAIN || errno == EWOULDBLOCK) return Result::WouldBlock;
+                return Result::Error;
+            }
+            outSent += sent;
+        }
+#else
+        for(; outSent < datagrams.size(); outSent++)
+        {
+            const auto& datagram = datagrams[outSent];
+            ssize_t sent = ::sendto(socketFd, datagram.data.data(), datagram.data.size(), 0, (sockaddr*)&addrs[outSent], sizeof(sockaddr_in));
+            if(sent < 0)
+            {
+                if(errno == EAGAIN || errno == EWOULDBLOCK) return Result::WouldBlock;
+                return Result::Error;
+            }
+        }
+#endif
+        return Result::Success;
+    }
+
+    Socket::Result Socket::recvBatch(std::span<Datagram> datagrams, size_t capacity, size_t& outReceived)
+    {
+        outReceived = 0;
+        if(socketFd < 0) return Result::Error;
+        if(datagrams.empty()) return Result::Success;
+
+        std::vector<sockaddr_in> addrs(datagrams.size());
+        for(auto& datagram : datagrams) datagram.data.resize(capacity);
+
+        std::lock_guard<std::mutex> recvLock(mutex);
+#if defined(__linux__)
+        std::vector<iovec> iovs(datagrams.size());
+        std::vector<mmsghdr> msgs(datagrams.size());
+        for(size_t i = 0; i < datagrams.size(); i++)
+        {
+            iovs[i].iov_base = datagrams[i].data.data();
+            iovs[i].iov_len = capacity;
+            msgs[i] = {};
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int recvd;
+        do
+        {
+            recvd = ::recvmmsg(socketFd, msgs.data(), datagrams.size(), MSG_DONTWAIT, nullptr);
+        } while(recvd < 0 && errno == EINTR);
+
+        if(recvd < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return Result::WouldBlock;
+            return Result::Error;
+        }
+
+        for(int i = 0; i < recvd; i++)
+        {
+            // 切り詰められたものは空にして呼び出し側で捨てさせる
+            size_t length = (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) ? 0 : msgs[i].msg_len;
+            datagrams[i].data.resize(length);
+            datagrams[i].ipAddress = addrs[i].sin_addr.s_addr;
+            datagrams[i].port = ntohs(addrs[i].sin_port);
+        }
+        outReceived = recvd;
+#else
+        for(; outReceived < datagrams.size(); outReceived++)
+        {
+            auto& datagram = datagrams[outReceived];
+            socklen_t len = sizeof(sockaddr_in);
+            ssize_t recvd = ::recvfrom(socketFd, datagram.data.data(), capacity, 0, (sockaddr*)&addrs[outReceived], &len);
+            if(recvd < 0)
+            {
+                if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+                if(outReceived > 0) break;
+                return Result::Error;
+            }
+            datagram.data.resize(recvd);
+            datagram.ipAddress = addrs[outReceived].sin_addr.s_addr;
+            datagram.port = ntohs(addrs[outReceived].sin_port);
+        }
+        if(outReceived == 0) return Result::WouldBlock;
+#endif
+        return Result::Success;
+    }
+
     Socket::Result Socket::close()
     {
         if(socketFd >= 0)
@@ -1,115 +1,1109 @@
 #include "StardustLib/TCPServer.hpp"
+#include "StardustLib/Buffer.hpp"
+#include "StardustLib/Compression.hpp"
 
 #include <algorithm>
+#include <cerrno>
 #include <chrono>
 #include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#endif
+
+#ifdef __WIIU__
 #include <nn/ac.h>
+#include <whb/log.h>
+#else
+#define WHBLogPrintf(...) ((void)0)
+#endif
+
+namespace StardustLib
+{
+    namespace
+    {
+        void writeU32(uint8_t* dst, uint32_t value)
+        {
+            uint32_t valueBE = toBigEndian(value);
+            std::memcpy(dst, &valueBE, sizeof(valueBE));
+        }
+
+        uint32_t readU32(const uint8_t* src)
+        {
+            uint32_t value;
+            std::memcpy(&value, src, sizeof(value));
+            return fromBigEndian(value);
+        }
+
+        void writeU64(uint8_t* dst, uint64_t value)
+        {
+            uint64_t valueBE = toBigEndian(value);
+            std::memcpy(dst, &valueBE, sizeof(valueBE));
+        }
+
+        uint64_t readU64(const uint8_t* src)
+        {
+            uint64_t value;
+            std::memcpy(&value, src, sizeof(value));
+            return fromBigEndian(value);
+        }
+
+        // io_uring の user_data。上位 32 ビットが操作、下位がクライアント ID
+        enum class UringOp : uint32_t { Accept, UnixAccept, Recv, Send, Wake, Datagram, SharedEvent, Cancel };
+
+        uint64_t uringData(UringOp op, uint32_t id = 0)
+        {
+            return ((uint64_t)op << 32) | id;
+        }
+
+        uint64_t elapsedNs(std::chrono::steady_clock::time_point begin)
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+        }
+
+        void pinThread(std::jthread& thread, int cpu)
+        {
+#ifdef __linux__
+            if(cpu < 0 || !thread.joinable()) return;
+
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            if(pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) != 0)
+            {
+                WHBLogPrintf("[start] failed to pin thread to cpu %d", cpu);
+            }
+#else
+            (void)thread;
+            (void)cpu;
+#endif
+        }
+    }
+
+    bool TCPServer::initializeServerIPAddress()
+    {
+#ifdef __WIIU__
+        if (nn::ac::Initialize().IsFailure()) return false;
+        if (nn::ac::Connect().IsFailure()) return false;
+        if (nn::ac::GetAssignedAddress(&serverIPAddress).IsFailure()) return false;
+        return true;
+#else
+        return false;
+#endif
+    }
+    
+    void TCPServer::finalizeServerIPAddress()
+    {
+#ifdef __WIIU__
+        nn::ac::Finalize();
+#endif
+    }
+    
+    bool TCPServer::start()
+    {
+        if(options.useIoUring)
+        {
+            uring = std::make_unique<IoUring>();
+            if(!uring->init(options.uringEntries, options.uringBufferCount, options.uringBufferSize))
+            {
+                WHBLogPrintf("[start] io_uring unavailable, falling back to poll");
+                uring.reset();
+            }
+        }
+
+        // io_uring のときは transfer スレッドが accept するので 1 つで足りる
+        unsigned listenerCount = 1;
+#ifdef SO_REUSEPORT
+        if(!uring) listenerCount = std::max(options.acceptThreads, 1u);
+#endif
+        for(unsigned i = 0; i < listenerCount; i++)
+        {
+            auto listener = std::make_unique<Socket>();
+            if(listener->create(true, true) != Socket::Result::Success) return false;
+            if(listenerCount > 1 && listener->enableReusePort() != Socket::Result::Success) return false;
+            if(listener->bind(port) != Socket::Result::Success) return false;
+            if(listener->listen(options.listenBacklog) != Socket::Result::Success) return false;
+            listenSockets.push_back(std::move(listener));
+        }
+
+        if(!options.unixSocketPath.empty())
+        {
+            unixListenSocket = std::make_unique<Socket>();
+            if(unixListenSocket->createUnix(true) != Socket::Result::Success) return false;
+            if(unixListenSocket->bind(options.unixSocketPath.c_str()) != Socket::Result::Success) return false;
+            if(unixListenSocket->listen() != Socket::Result::Success) return false;
+        }
+
+        if(options.datagramPort != 0)
+        {
+            datagramSocket = std::make_unique<Socket>();
+            if(datagramSocket->createDatagram(true) != Socket::Result::Success) return false;
+            if(datagramSocket->bind(options.datagramPort) != Socket::Result::Success) return false;
+        }
+    
+#ifdef __linux__
+        if(!uring) transferWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+        // 1 コアでは回っている間は相手側が動けず遅くなるだけなので使わない
+        uint32_t spinMicroseconds = std::thread::hardware_concurrency() == 1 ? 0 : options.spinMicroseconds;
+        transferSpin.configure(spinMicroseconds);
+        processSpin.configure(spinMicroseconds);
+
+        if(uring)
+        {
+            // accept も transfer スレッドの io_uring で受ける
+            transferThread = std::jthread([this](std::stop_token token)
+            {
+                runUringLoop(token);
+            });
+        }
+        else
+        {
+            for(size_t i = 0; i < listenSockets.size(); i++)
+            {
+                std::vector<Socket*> listeners = { listenSockets[i].get() };
+                if(i == 0 && unixListenSocket) listeners.push_back(unixListenSocket.get());
+                acceptThreads.emplace_back([this, listeners](std::stop_token token)
+                {
+                    runAcceptLoop(token, listeners);
+                });
+            }
+            transferThread = std::jthread([this](std::stop_token token)
+            {
+                runTransferLoop(token);
+            });
+        }
+        if(!options.runToCompletion)
+        {
+            processThread = std::jthread([this](std::stop_token token)
+            {
+                runProcessLoop(token);
+            });
+        }
+        pinThread(transferThread, options.transferCpu);
+        pinThread(processThread, options.processCpu);
+    
+        if(initializeServerIPAddress())
+        {
+            if(serverIPAddressCallback) serverIPAddressCallback(serverIPAddress);
+        }
+    
+        return true;
+    }
+    
+    void TCPServer::stop()
+    {
+        for(auto& thread : acceptThreads) thread.request_stop();
+        transferThread.request_stop();
+        processThread.request_stop();
+
+        // ソケットやクライアントを片付ける前にループを抜けさせる
+        wakeTransfer();
+        {
+            std::lock_guard<std::mutex> lock(queueMtx);
+            queueCv.notify_all();
+        }
+        for(auto& thread : acceptThreads)
+        {
+            if(thread.joinable()) thread.join();
+        }
+        acceptThreads.clear();
+        for(auto* thread : { &transferThread, &processThread })
+        {
+            if(thread->joinable() && thread->get_id() != std::this_thread::get_id()) thread->join();
+        }
+        uring.reset();
+        if(transferWakeFd >= 0)
+        {
+            ::close(transferWakeFd);
+            transferWakeFd = -1;
+        }
+    
+        for(auto& listener : listenSockets) listener->close();
+        listenSockets.clear();
+        if(datagramSocket) datagramSocket->close();
+        if(unixListenSocket && unixListenSocket->getFd() >= 0)
+        {
+            unixListenSocket->close();
+            ::unlink(options.unixSocketPath.c_str());
+        }
+    
+        std::lock_guard<std::mutex> lock(clientsMtx);
+        for(auto& client : clients)
+        {
+            if(client && client->socket)
+            {
+                client->socket->close();
+            }
+        }
+        clients.clear();
+
+        // transfer スレッドが受け取る前に止まったもの
+        for(Client* pending = pendingClients.exchange(nullptr); pending; )
+        {
+            Client* next = pending->nextPending;
+            delete pending;
+            pending = next;
+        }
+
+        stopCapture();
+
+        // 未発火のタイマーは捨てる（接続ごとのものは消した Client を指している）
+        {
+            std::lock_guard<std::mutex> timerLock(timersMtx);
+            timers = TimerWheel(currentTick());
+        }
+    
+        finalizeServerIPAddress();
+    }
+    
+    std::shared_ptr<TCPServer::Client> TCPServer::findClient(uint32_t clientId)
+    {
+        std::lock_guard<std::mutex> lock(clientsMtx);
+        for(auto& c : clients)
+        {
+            if(c->id == clientId) return c;
+        }
+        return nullptr;
+    }
+
+    bool TCPServer::send(Packet packet)
+    {
+        // 分割や圧縮の間に transfer スレッドが切断を処理しても、ここで持っている参照で生き残る
+        std::shared_ptr<Client> client = findClient(packet.clientId);
+        if(!client) return false;
+
+        if(classifyCallback && (packet.priority == Priority::Unspecified || packet.delivery == Delivery::Unspecified)) classifyCallback(packet);
+        if(packet.delivery != Delivery::Reliable && packet.delivery != Delivery::Unspecified && sendDatagram(*client, packet)) return true;
+
+        Priority priority = packet.priority;
+        if(priority == Priority::Unspecified) priority = Priority::Normal;
+
+        std::vector<std::vector<uint8_t>> chunks;
+        if(options.framed) encodeFrames(*client, 0, packet.data, priority, chunks);
+        else chunks.push_back(std::move(packet.data));
+    
+        bool wasIdle;
+        {
+            std::lock_guard<std::mutex> sendLock(client->sendMutex);
+
+            wasIdle = client->sendingOffset >= client->sending.size()
+                && std::all_of(client->sendQueues.begin(), client->sendQueues.end(), [](const auto& queue) { return queue.empty(); });
+        
+            auto& queue = client->sendQueues[(size_t)priority];
+            for(auto& chunk : chunks) queue.push_back(std::move(chunk));
+        }
+        // transfer ループは送るものがない間は寝ている
+        if(wasIdle) wakeTransfer();
+        return true;
+    }
+
+    void TCPServer::wakeTransfer()
+    {
+        // transfer スレッド自身（run-to-completion のハンドラーなど）は起こす必要がない
+        if(std::this_thread::get_id() == transferThread.get_id()) return;
+
+        if(uring)
+        {
+            uring->wake();
+            return;
+        }
+#ifdef __linux__
+        if(transferWakeFd >= 0)
+        {
+            uint64_t one = 1;
+            ssize_t ret = ::write(transferWakeFd, &one, sizeof(one));
+            (void)ret;
+        }
+#endif
+    }
+
+    uint64_t TCPServer::currentTick() const
+    {
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - timerEpoch).count();
+        return (uint64_t)elapsed / std::max<uint32_t>(options.timerTickMs, 1);
+    }
+
+    TCPServer::TimerId TCPServer::schedule(std::chrono::milliseconds after, std::function<void()> fn)
+    {
+        uint64_t tickMs = std::max<uint32_t>(options.timerTickMs, 1);
+        // 今の tick の途中から数えるので 1 つ足して、早く呼ばれないようにする
+        uint64_t delay = ((uint64_t)std::max<int64_t>(after.count(), 0) + tickMs - 1) / tickMs + 1;
+
+        TimerId id;
+        {
+            std::lock_guard<std::mutex> lock(timersMtx);
+            // ホイールが実時間より遅れている分を足す
+            uint64_t now = currentTick();
+            if(now > timers.now()) delay += now - timers.now();
+
+            id = timers.schedule(delay, [this, fn = std::move(fn)]() mutable
+            {
+                if(options.runToCompletion)
+                {
+                    fn();
+                    return;
+                }
+
+                std::lock_guard<std::mutex> qlk(queueMtx);
+                taskQueue.push_back(std::move(fn));
+                queueReady.store(true, std::memory_order_release);
+                queueCv.notify_one();
+            });
+        }
+        wakeTransfer();
+        return id;
+    }
+
+    bool TCPServer::cancel(TimerId id)
+    {
+        std::lock_guard<std::mutex> lock(timersMtx);
+        return timers.cancel(id);
+    }
+
+    int TCPServer::timerTimeout(int timeoutMs)
+    {
+        uint64_t next;
+        uint64_t at;
+        {
+            std::lock_guard<std::mutex> lock(timersMtx);
+            next = timers.ticksUntilNext();
+            if(next == UINT64_MAX) return timeoutMs;
+            at = timers.now() + next;
+        }
+
+        uint64_t tickMs = std::max<uint32_t>(options.timerTickMs, 1);
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - timerEpoch).count();
+        int64_t remaining = (int64_t)(at * tickMs) - elapsed;
+        return (int)std::clamp<int64_t>(remaining, 0, timeoutMs);
+    }
+
+    void TCPServer::runTimers()
+    {
+        std::vector<TimerWheel::Callback> due;
+        {
+            std::lock_guard<std::mutex> lock(timersMtx);
+            timers.advance(currentTick(), due);
+            transferTick = timers.now();
+        }
+        for(auto& callback : due) callback();
+    }
+
+    void TCPServer::watchIdle(Client& client)
+    {
+        client.lastActivityTick = transferTick;
+        onIdleCheck(client);
+    }
+
+    void TCPServer::onIdleCheck(Client& client)
+    {
+        client.idleTimer = 0;
+        if(client.expired) return;
+
+        uint64_t tickMs = std::max<uint32_t>(options.timerTickMs, 1);
+        uint64_t idleLimit = (options.idleTimeoutMs + tickMs - 1) / tickMs;
+        uint64_t keepalive = options.framed ? (options.keepaliveIntervalMs + tickMs - 1) / tickMs : 0;
+        uint64_t idle = transferTick - client.lastActivityTick;
+
+        if(idleLimit && idle >= idleLimit)
+        {
+            WHBLogPrintf("[timer] idle timeout id=%llu", (unsigned long long)client.id);
+            client.expired = true;
+            return;
+        }
+
+        // 受信があれば時刻が更新されているので、残りの時間だけ待ち直す
+        uint64_t next = UINT64_MAX;
+        if(keepalive)
+        {
+            if(idle >= keepalive)
+            {
+                uint8_t ping[5] = { (uint8_t)Frame::Control::Ping };
+                writeU32(ping + 1, (uint32_t)transferTick);
+                queueControl(client, ping);
+                next = keepalive;
+            }
+            else next = keepalive - idle;
+        }
+        if(idleLimit) next = std::min(next, idleLimit - idle);
+        if(next == UINT64_MAX) return;
+
+        std::lock_guard<std::mutex> lock(timersMtx);
+        client.idleTimer = timers.schedule(next, [this, &client] { onIdleCheck(client); });
+    }
+
+    void TCPServer::unwatchIdle(Client& client)
+    {
+        if(client.idleTimer == 0) return;
+
+        std::lock_guard<std::mutex> lock(timersMtx);
+        timers.cancel(client.idleTimer);
+        client.idleTimer = 0;
+    }
+
+    bool TCPServer::sendDatagram(Client& client, const Packet& packet)
+    {
+        if(!datagramSocket || packet.data.size() > options.maxDatagramSize) return false;
+
+        uint64_t endpoint = client.datagramEndpoint.load(std::memory_order_acquire);
+        if(endpoint == 0) return false;
+
+        uint32_t sequence = 0;
+        if(packet.delivery == Delivery::UnreliableSequenced)
+        {
+            sequence = ++client.datagramSequence;
+            if(sequence == 0) sequence = ++client.datagramSequence;
+        }
+
+        Socket::Datagram datagram;
+        datagram.ipAddress = (uint32_t)(endpoint >> 16);
+        datagram.port = (uint16_t)endpoint;
+        datagram.data.resize(Frame::DatagramHeaderSize);
+        writeU32(datagram.data.data(), client.id);
+        writeU64(datagram.data.data() + 4, client.datagramToken);
+        writeU32(datagram.data.data() + 12, sequence);
+        datagram.data.insert(datagram.data.end(), packet.data.begin(), packet.data.end());
+
+        bool wasEmpty;
+        {
+            std::lock_guard<std::mutex> lock(datagramMtx);
+            wasEmpty = datagramQueue.empty();
+            datagramQueue.push_back(std::move(datagram));
+        }
+
+        // transfer ループは送るものがない間は寝ている
+        if(wasEmpty) wakeTransfer();
+        return true;
+    }
+
+    bool TCPServer::simulateLoss()
+    {
+        if(options.simulatedLoss <= 0.0) return false;
+        return std::uniform_real_distribution<double>(0.0, 1.0)(lossRandom) < options.simulatedLoss;
+    }
+
+    void TCPServer::receiveDatagrams()
+    {
+        std::vector<Packet> packets;
+        std::vector<Socket::Datagram> batch(32);
+
+        while(true)
+        {
+            size_t received = 0;
+            if(datagramSocket->recvBatch(batch, Frame::DatagramHeaderSize + options.maxDatagramSize, received) != Socket::Result::Success) break;
+
+            for(size_t i = 0; i < received; i++)
+            {
+                const auto& datagram = batch[i];
+                if(datagram.data.size() < Frame::DatagramHeaderSize) continue;
+                if(simulateLoss()) continue;
+
+                uint32_t clientId = readU32(datagram.data.data());
+                uint64_t token = readU64(datagram.data.data() + 4);
+                uint32_t sequence = readU32(datagram.data.data() + 12);
+
+                std::shared_ptr<Client> client = findClient(clientId);
+                if(!client || client->datagramToken != token) continue;
+                client->lastActivityTick = transferTick;
+
+                // 最後に受け取ったアドレスへ返す（NAT の張り替えにも追従する）
+                client->datagramEndpoint.store(((uint64_t)datagram.ipAddress << 16) | datagram.port, std::memory_order_release);
+
+                std::span<const uint8_t> message(datagram.data.data() + Frame::DatagramHeaderSize, datagram.data.size() - Frame::DatagramHeaderSize);
+                if(sequence != 0 && message.size() >= sizeof(uint32_t))
+                {
+                    uint32_t& last = client->lastDatagramSequence[readU32(message.data())];
+                    if(last != 0 && (int32_t)(sequence - last) <= 0) continue;
+                    last = sequence;
+                }
+
+                Packet pkt;
+                pkt.clientId = clientId;
+                pkt.data.assign(message.begin(), message.end());
+                pkt.delivery = sequence != 0 ? Delivery::UnreliableSequenced : Delivery::Unreliable;
+                packets.push_back(std::move(pkt));
+            }
+
+            if(received < batch.size()) break;
+        }
+
+        pushPackets(packets);
+    }
+
+    void TCPServer::flushDatagrams()
+    {
+        std::vector<Socket::Datagram> batch;
+        {
+            std::lock_guard<std::mutex> lock(datagramMtx);
+            if(datagramQueue.empty()) return;
+            batch.swap(datagramQueue);
+        }
+
+        if(options.simulatedLoss > 0.0)
+        {
+            std::erase_if(batch, [this](const Socket::Datagram&) { return simulateLoss(); });
+        }
+
+        size_t sent = 0;
+        auto res = datagramSocket->sendBatch(batch, sent);
+        if(res != Socket::Result::Success)
+        {
+            WHBLogPrintf("[transfer] datagram send res=%d dropped=%d", (int)res, (int)(batch.size() - sent));
+        }
+    }
+
+    bool TCPServer::startCapture(const std::string& path)
+    {
+        auto writer = std::make_unique<CaptureWriter>();
+        if(!writer->open(path)) return false;
+
+        std::unique_ptr<CaptureWriter> previous;
+        {
+            std::lock_guard<std::mutex> lock(captureMtx);
+            previous = std::move(capture);
+            capture = std::move(writer);
+            capturing = true;
+        }
+        // 前のキャプチャの書き出しはロックの外で待つ
+        previous.reset();
+        return true;
+    }
+
+    Capture::Stats TCPServer::stopCapture()
+    {
+        std::unique_ptr<CaptureWriter> writer;
+        {
+            std::lock_guard<std::mutex> lock(captureMtx);
+            capturing = false;
+            writer = std::move(capture);
+        }
+        if(!writer) return {};
+
+        writer->close();
+        return writer->getStats();
+    }
+
+    Capture::Stats TCPServer::getCaptureStats() const
+    {
+        std::lock_guard<std::mutex> lock(captureMtx);
+        return capture ? capture->getStats() : Capture::Stats{};
+    }
+
+    TCPServer::SpinStats TCPServer::getSpinStats() const
+    {
+        SpinStats stats;
+        stats.transfer = transferSpin.getStats();
+        stats.process = processSpin.getStats();
+        return stats;
+    }
+
+    TCPServer::CompressionStats TCPServer::getCompressionStats() const
+    {
+        CompressionStats stats;
+        stats.rawBytes = statRawBytes.load(std::memory_order_relaxed);
+        stats.compressedBytes = statCompressedBytes.load(std::memory_order_relaxed);
+        stats.compressNanoseconds = statCompressNs.load(std::memory_order_relaxed);
+        stats.decompressedBytes = statDecompressedBytes.load(std::memory_order_relaxed);
+        stats.decompressNanoseconds = statDecompressNs.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    void TCPServer::encodeFrames(const Client& client, uint8_t flags, std::span<const uint8_t> payload, Priority priority, std::vector<std::vector<uint8_t>>& out)
+    {
+        std::vector<uint8_t> frame;
+        frame.resize(Frame::HeaderSize);
+
+        bool compress = !(flags & Frame::FlagControl)
+            && client.compress.load(std::memory_order_relaxed)
+            && payload.size() >= options.compressionThreshold;
+        if(compress)
+        {
+            auto begin = std::chrono::steady_clock::now();
+            frame.resize(Frame::HeaderSize + sizeof(uint32_t));
+            writeU32(frame.data() + Frame::HeaderSize, (uint32_t)payload.size());
+            bool compressed = Compression::compress(payload, frame);
+
+            statRawBytes.fetch_add(payload.size(), std::memory_order_relaxed);
+            statCompressNs.fetch_add(elapsedNs(begin), std::memory_order_relaxed);
+
+            if(compressed)
+            {
+                flags |= Frame::FlagCompressed;
+                statCompressedBytes.fetch_add(frame.size() - Frame::HeaderSize, std::memory_order_relaxed);
+            }
+            else
+            {
+                // 縮まないデータはそのまま送る
+                frame.resize(Frame::HeaderSize);
+                statCompressedBytes.fetch_add(payload.size(), std::memory_order_relaxed);
+            }
+        }
+
+        flags |= (uint8_t)((size_t)priority << Frame::LaneShift) & Frame::LaneMask;
+
+        std::span<const uint8_t> body = (flags & Frame::FlagCompressed) ? std::span<const uint8_t>(frame).subspan(Frame::HeaderSize) : payload;
+        size_t chunkSize = std::max<size_t>(options.chunkSize, 1);
+
+        if(body.size() <= chunkSize || (flags & Frame::FlagControl))
+        {
+            if(!(flags & Frame::FlagCompressed)) frame.insert(frame.end(), payload.begin(), payload.end());
+
+            writeU32(frame.data(), (uint32_t)(frame.size() - Frame::LengthSize));
+            frame[Frame::LengthSize] = flags;
+            out.push_back(std::move(frame));
+            return;
+        }
+
+        // 他のレーンが割り込めるようにチャンクへ分割する
+        for(size_t offset = 0; offset < body.size(); offset += chunkSize)
+        {
+            size_t size = std::min(chunkSize, body.size() - offset);
+            bool last = offset + size == body.size();
+
+            std::vector<uint8_t> chunk(Frame::HeaderSize);
+            chunk.reserve(Frame::HeaderSize + size);
+            chunk.insert(chunk.end(), body.begin() + offset, body.begin() + offset + size);
+            writeU32(chunk.data(), (uint32_t)(size + 1));
+            chunk[Frame::LengthSize] = flags | (last ? 0 : Frame::FlagContinued);
+            out.push_back(std::move(chunk));
+        }
+    }
+
+    bool TCPServer::onReceived(Client& client, const uint8_t* data, size_t size, bool fromShared)
+    {
+        std::vector<Packet> packets;
+        client.lastActivityTick = transferTick;
+
+        // 切り替えた後にソケットへ来たものは、リングとの順序が決まらないので受け付けない
+        if(!fromShared && client.sharedAttached)
+        {
+            WHBLogPrintf("[transfer] data on socket after shared memory attach id=%llu", (unsigned long long)client.id);
+            return false;
+        }
+
+        if(!options.framed)
+        {
+            Packet pkt;
+            pkt.clientId = client.id;
+            pkt.data.assign(data, data + size);
+            packets.push_back(std::move(pkt));
+            pushPackets(packets);
+            return true;
+        }
+
+        auto& buffer = client.recvBuffer;
+        buffer.insert(buffer.end(), data, data + size);
+
+        size_t pos = 0;
+        bool ok = true;
+        while(buffer.size() - pos >= Frame::LengthSize)
+        {
+            uint32_t length = readU32(buffer.data() + pos);
+            if(length == 0 || length > options.maxFrameSize)
+            {
+                WHBLogPrintf("[transfer] invalid frame id=%llu length=%u", (unsigned long long)client.id, length);
+                ok = false;
+                break;
+            }
+            if(buffer.size() - pos - Frame::LengthSize < length) break;
+
+            uint8_t flags = buffer[pos + Frame::LengthSize];
+            std::span<const uint8_t> payload(buffer.data() + pos + Frame::HeaderSize, length - 1);
+            pos += Frame::LengthSize + length;
+
+            bool attached = client.sharedAttached;
+            if(!decodeFrame(client, flags, payload, packets))
+            {
+                ok = false;
+                break;
+            }
+
+            // ソケットのストリームは SharedMemory で終わる（後ろに続くものはリングで送られるはず）
+            if(!attached && client.sharedAttached && pos != buffer.size())
+            {
+                WHBLogPrintf("[transfer] data after shared memory attach id=%llu", (unsigned long long)client.id);
+                ok = false;
+                break;
+            }
+        }
+        buffer.erase(buffer.begin(), buffer.begin() + pos);
+
+        pushPackets(packets);
+        return ok;
+    }
+
+    bool TCPServer::decodeFrame(Client& client, uint8_t flags, std::span<const uint8_t> payload, std::vector<Packet>& out)
+    {
+        if(flags & Frame::FlagControl)
+        {
+            if(payload.empty()) return false;
+            switch((Frame::Control)payload[0])
+            {
+            case Frame::Control::Hello:
+                if(payload.size() >= 2 && options.compression)
+                {
+                    client.compress = (payload[1] & Frame::CapabilityCompression) != 0;
+                }
+                break;
+            case Frame::Control::Ping:
+            {
+                std::vector<uint8_t> pong(payload.begin(), payload.end());
+                pong[0] = (uint8_t)Frame::Control::Pong;
+                queueControl(client, pong);
+                break;
+            }
+            case Frame::Control::Pong:
+                // 受信したこと自体で lastActivityTick が更新されている
+                break;
+            case Frame::Control::SharedMemory:
+                // クライアントが共有メモリに切り替えた印。以後の受信はリングから読む
+                if(client.shared) client.sharedAttached = true;
+                break;
+            case Frame::Control::Datagram:
+                // サーバーからクライアントへの通知専用
+                break;
+            }
+            return true;
+        }
+
+        // 分割されたフレームはレーンごとに最後のチャンクまで連結する
+        auto& partial = client.partialFrames[(flags & Frame::LaneMask) >> Frame::LaneShift];
+        std::vector<uint8_t> assembled;
+        if((flags & Frame::FlagContinued) || !partial.empty())
+        {
+            if(partial.size() + payload.size() > options.maxFrameSize) return false;
+            partial.insert(partial.end(), payload.begin(), payload.end());
+            if(flags & Frame::FlagContinued) return true;
+
+            assembled.swap(partial);
+            payload = assembled;
+        }
+
+        Packet pkt;
+        pkt.clientId = client.id;
+
+        if(flags & Frame::FlagCompressed)
+        {
+            if(payload.size() < sizeof(uint32_t)) return false;
+            uint32_t rawSize = readU32(payload.data());
+            if(rawSize > options.maxFrameSize) return false;
+
+            // 展開先はそのまま BufferReader に渡る Packet のバッファ
+            auto begin = std::chrono::steady_clock::now();
+            if(!Compression::decompress(payload.subspan(sizeof(uint32_t)), rawSize, pkt.data)) return false;
+            statDecompressedBytes.fetch_add(rawSize, std::memory_order_relaxed);
+            statDecompressNs.fetch_add(elapsedNs(begin), std::memory_order_relaxed);
+        }
+        else
+        {
+            pkt.data.assign(payload.begin(), payload.end());
+        }
+
+        out.push_back(std::move(pkt));
+        return true;
+    }
+
+    void TCPServer::queueControl(Client& client, std::span<const uint8_t> payload)
+    {
+        std::vector<std::vector<uint8_t>> frames;
+        encodeFrames(client, Frame::FlagControl, payload, Priority::Control, frames);
+
+        std::lock_guard<std::mutex> sendlk(client.sendMutex);
+        for (auto& frame : frames) client.sendQueues[(size_t)Priority::Control].push_back(std::move(frame));
+    }
+
+    void TCPServer::pushPackets(std::vector<Packet>& packets)
+    {
+        if(packets.empty()) return;
+
+        if(capturing.load(std::memory_order_relaxed))
+        {
+            std::lock_guard<std::mutex> captureLock(captureMtx);
+            if(capture && capture->hasFailed())
+            {
+                // 書き出せなくなったら記録をやめる（stopCapture の Stats::failed で分かる）
+                WHBLogPrintf("[capture] write failed, capture stopped");
+                capturing = false;
+            }
+            else if(capture)
+            {
+                for(const auto& pkt : packets) capture->append(pkt.clientId, (uint8_t)pkt.delivery, pkt.data);
+            }
+        }
+
+        if(options.runToCompletion)
+        {
+            // 処理スレッドへの受け渡しを省いて、その場でハンドラーまで実行する
+            deliverPackets(packets);
+            packets.clear();
+            return;
+        }
+
+        std::lock_guard<std::mutex> qlk(queueMtx);
+        for(auto& pkt : packets) packetQueue.push_back(std::move(pkt));
+        queueReady.store(true, std::memory_order_release);
+        queueCv.notify_one();
+    }
+
+    void TCPServer::deliverPackets(std::span<const Packet> packets)
+    {
+        if(batchRecvCallback)
+        {
+            batchRecvCallback(packets);
+        }
+        else if(recvCallback)
+        {
+            for(const auto& packet : packets) recvCallback(packet);
+        }
+    }
+    
+    bool TCPServer::hasPendingSend(Client& client)
+    {
+        std::lock_guard<std::mutex> sendlk(client.sendMutex);
+        if (client.sendingOffset < client.sending.size()) return true;
+        for (auto& queue : client.sendQueues)
+        {
+            if (!queue.empty()) return true;
+        }
+        return false;
+    }
+
+    bool TCPServer::selectNextChunk(Client& client)
+    {
+        // 重み 0 のレーンは常に先に送る
+        for (size_t lane = 0; lane < PriorityCount; ++lane)
+        {
+            auto& queue = client.sendQueues[lane];
+            if (options.laneWeights[lane] == 0 && !queue.empty())
+            {
+                client.sending = std::move(queue.front());
+                queue.pop_front();
+                return true;
+            }
+        }
+
+        // 残りは重み付きラウンドロビン。使い切ったらクレジットを補充してもう一巡
+        for (int pass = 0; pass < 2; ++pass)
+        {
+            for (size_t lane = 0; lane < PriorityCount; ++lane)
+            {
+                auto& queue = client.sendQueues[lane];
+                if (queue.empty() || client.laneCredits[lane] == 0) continue;
+
+                client.laneCredits[lane]--;
+                client.sending = std::move(queue.front());
+                queue.pop_front();
+                return true;
+            }
+            client.laneCredits = options.laneWeights;
+        }
+        return false;
+    }
+
+    bool TCPServer::flushSend(Client& client)
+    {
+        std::lock_guard<std::mutex> sendlk(client.sendMutex);
+        while (true)
+        {
+            if (client.sendingOffset >= client.sending.size())
+            {
+                client.sending.clear();
+                client.sendingOffset = 0;
+                if (!selectNextChunk(client)) return true;
+            }
+
+            ssize_t sent = 0;
+            auto sres = transportSend(client, client.sending.data() + client.sendingOffset, client.sending.size() - client.sendingOffset, sent);
+            WHBLogPrintf("[transfer] send id=%llu sres=%d sent=%d remaining=%d",
+                         (unsigned long long)client.id, (int)sres, (int)sent, (int)(client.sending.size() - client.sendingOffset));
+
+            if (sres == Socket::Result::Success)
+            {
+                client.sendingOffset += sent;
+            }
+            else if (sres == Socket::Result::WouldBlock)
+            {
+                return true;
+            }
+            else
+            {
+                return false;
+            }
+        }
+    }
+    
+    Socket::Result TCPServer::transportSend(Client& client, const uint8_t* data, size_t size, ssize_t& outBytes)
+    {
+        if (!client.shared) return client.socket->send(data, size, outBytes);
 
-#include <whb/log.h>
+        size_t written = 0;
+        if (!client.shared->outbound().write(data, size, written))
+        {
+            WHBLogPrintf("[transfer] shared ring corrupted id=%llu", (unsigned long long)client.id);
+            outBytes = 0;
+            return Socket::Result::Error;
+        }
+        outBytes = written;
+        if (outBytes == 0) return Socket::Result::WouldBlock;
+        client.shared->notifyAfterWrite();
+        return Socket::Result::Success;
+    }
 
-namespace StardustLib
-{
-    bool TCPServer::initializeServerIPAddress()
+    bool TCPServer::receiveShared(Client& client, std::vector<uint8_t>& buf)
     {
-        if (nn::ac::Initialize().IsFailure()) return false;
-        if (nn::ac::Connect().IsFailure()) return false;
-        if (nn::ac::GetAssignedAddress(&serverIPAddress).IsFailure()) return false;
+        // 1 回の巡回で読みすぎないように上限を設ける
+        for (int i = 0; i < 16; ++i)
+        {
+            size_t recvd = 0;
+            if (!client.shared->inbound().read(buf.data(), buf.size(), recvd))
+            {
+                WHBLogPrintf("[transfer] shared ring corrupted id=%llu", (unsigned long long)client.id);
+                return false;
+            }
+            if (recvd == 0) break;
+            client.shared->notifyAfterRead();
+            if (!onReceived(client, buf.data(), recvd, true)) return false;
+        }
         return true;
     }
-    
-    void TCPServer::finalizeServerIPAddress()
+
+    bool TCPServer::offerSharedMemory(Client& client)
     {
-        nn::ac::Finalize();
+        auto channel = SharedChannel::create(options.sharedRingSize);
+        if (!channel) return false;
+
+        uint8_t payload[5] = { (uint8_t)Frame::Control::SharedMemory };
+        writeU32(payload + 1, (uint32_t)channel->getCapacity());
+        std::vector<std::vector<uint8_t>> frames;
+        encodeFrames(client, Frame::FlagControl, payload, Priority::Control, frames);
+
+        const int fds[] = { channel->getMemoryFd(), channel->getServerEventFd(), channel->getClientEventFd() };
+        if (client.socket->sendWithFds(frames[0].data(), frames[0].size(), fds) != Socket::Result::Success) return false;
+
+        client.shared = std::move(channel);
+        return true;
     }
-    
-    bool TCPServer::start()
+
+    Socket::Result TCPServer::acceptClient(Socket& listener, bool local)
     {
-        listenSocket = std::make_unique<Socket>();
-        if(listenSocket->create(true, true) != Socket::Result::Success) return false;
-        if(listenSocket->bind(port) != Socket::Result::Success) return false;
-        if(listenSocket->listen() != Socket::Result::Success) return false;
+        uint32_t outIPAddress = 0;
+        std::unique_ptr<Socket> newSock;
+        auto ares = listener.accept(newSock, outIPAddress);
     
-        acceptThread = std::jthread([this](std::stop_token token)
+        WHBLogPrintf("[accept] result=%d newFd=%d ip=0x%08x", (int)ares, newSock ? newSock->getFd() : -1, outIPAddress);
+        if (ares != Socket::Result::Success) return ares;
+
+        if (!newSock || newSock->getFd() < 0)
         {
-            runAcceptLoop(token);
-        });
-        transferThread = std::jthread([this](std::stop_token token)
+            WHBLogPrintf("[accept] accepted invalid socket, ignoring");
+            return ares;
+        }
+
+        // clientsMtx は取らずに transfer スレッドへ渡す
+        Client* pending = makeClient(std::move(newSock), outIPAddress, local).release();
+        Client* head = pendingClients.load(std::memory_order_relaxed);
+        do
         {
-            runTransferLoop(token);
-        });
-        processThread = std::jthread([this](std::stop_token token)
+            pending->nextPending = head;
+        } while (!pendingClients.compare_exchange_weak(head, pending, std::memory_order_release, std::memory_order_relaxed));
+        if (!head) wakeTransfer();
+        return ares;
+    }
+
+    std::unique_ptr<TCPServer::Client> TCPServer::makeClient(std::unique_ptr<Socket> socket, uint32_t ipAddress, bool local)
+    {
+        auto client = std::make_unique<Client>();
+        client->id = clientCounter++;
+        client->ipAddress = ipAddress;
+        client->socket = std::move(socket);
+        if (!local && options.busyPollMicroseconds > 0 && client->socket->setBusyPoll(options.busyPollMicroseconds) != Socket::Result::Success)
         {
-            runProcessLoop(token);
-        });
-    
-        if(initializeServerIPAddress())
+            WHBLogPrintf("[accept] SO_BUSY_POLL unavailable id=%llu", (unsigned long long)client->id);
+        }
+        if (local && options.framed && options.sharedRingSize > 0 && !offerSharedMemory(*client))
         {
-            if(serverIPAddressCallback) serverIPAddressCallback(serverIPAddress);
+            WHBLogPrintf("[accept] shared memory unavailable id=%llu", (unsigned long long)client->id);
         }
-    
-        return true;
-    }
-    
-    void TCPServer::stop()
-    {
-        acceptThread.request_stop();
-        transferThread.request_stop();
-        processThread.request_stop();
-    
-        if(listenSocket) listenSocket->close();
-    
-        std::lock_guard<std::mutex> lock(clientsMtx);
-        for(auto& client : clients)
+        if (options.framed && options.compression)
+        {
+            const uint8_t hello[] = { (uint8_t)Frame::Control::Hello, Frame::CapabilityCompression };
+            std::vector<std::vector<uint8_t>> frames;
+            encodeFrames(*client, Frame::FlagControl, hello, Priority::Control, frames);
+            for (auto& frame : frames) client->sendQueues[(size_t)Priority::Control].push_back(std::move(frame));
+        }
+        if (!local && options.framed && datagramSocket)
         {
-            if(client && client->socket)
             {
-                client->socket->close();
+                std::lock_guard<std::mutex> tokenLock(tokenMtx);
+                client->datagramToken = ((uint64_t)tokenSource() << 32) | tokenSource();
             }
+
+            uint8_t datagram[15] = { (uint8_t)Frame::Control::Datagram, (uint8_t)(options.datagramPort >> 8), (uint8_t)options.datagramPort };
+            writeU32(datagram + 3, client->id);
+            writeU64(datagram + 7, client->datagramToken);
+            std::vector<std::vector<uint8_t>> frames;
+            encodeFrames(*client, Frame::FlagControl, datagram, Priority::Control, frames);
+            for (auto& frame : frames) client->sendQueues[(size_t)Priority::Control].push_back(std::move(frame));
         }
-        clients.clear();
-    
-        finalizeServerIPAddress();
+
+        return client;
     }
-    
-    bool TCPServer::send(Packet packet)
+
+    TCPServer::Client* TCPServer::addClient(std::unique_ptr<Client> client)
     {
-        Client* client = nullptr;
-    
+        Client* added = client.get();
         {
-            std::lock_guard<std::mutex> lock(clientsMtx);
-            for(auto& c : clients)
-            {
-                if(c->id == packet.clientId)
-                {
-                    client = c.get();
-                    break;
-                }
-            }
+            std::lock_guard<std::mutex> lk(clientsMtx);
+            clients.push_back(std::move(client));
+            WHBLogPrintf("[accept] pushed clients.size=%d", (int)clients.size());
         }
-    
-        if(!client) return false;
-    
+        if (clientIPAddressCallback) clientIPAddressCallback(added->ipAddress, added->id);
+        return added;
+    }
+
+    void TCPServer::adoptPendingClients()
+    {
+        Client* pending = pendingClients.exchange(nullptr, std::memory_order_acquire);
+        if (!pending) return;
+
+        // 積まれたのと逆順になっているので accept 順に戻す
+        std::vector<Client*> adopted;
+        for (; pending; pending = pending->nextPending) adopted.push_back(pending);
+        std::reverse(adopted.begin(), adopted.end());
+
         {
-            std::lock_guard<std::mutex> sendLock(client->sendMutex);
-        
-            client->sendQueue.push_back(std::move(packet.data));
+            std::lock_guard<std::mutex> lk(clientsMtx);
+            for (Client* client : adopted) clients.emplace_back(client);
+            WHBLogPrintf("[transfer] adopted %d clients.size=%d", (int)adopted.size(), (int)clients.size());
+        }
+        for (Client* client : adopted) watchIdle(*client);
+        // 消すのは transfer スレッドだけなので、ロックの外でも触ってよい
+        if (clientIPAddressCallback)
+        {
+            for (Client* client : adopted) clientIPAddressCallback(client->ipAddress, client->id);
         }
-        return true;
     }
     
-    void TCPServer::runAcceptLoop(std::stop_token token, int timeoutMs)
+    void TCPServer::runAcceptLoop(std::stop_token token, std::vector<Socket*> listeners, int timeoutMs)
     {
-        if (!listenSocket) return;
-        int listenFd = listenSocket->getFd();
-    
         while (!token.stop_requested())
         {
-            pollfd pfd{};
-            pfd.fd = listenFd;
-            pfd.events = POLLIN;
-            pfd.revents = 0;
+            std::vector<pollfd> pfds;
+            for (auto* listener : listeners)
+            {
+                pollfd pfd{};
+                pfd.fd = listener->getFd();
+                pfd.events = POLLIN;
+                pfd.revents = 0;
+                pfds.push_back(pfd);
+            }
         
-            int pret = poll(&pfd, 1, timeoutMs);
+            int pret = poll(pfds.data(), pfds.size(), timeoutMs);
             if (pret < 0)
             {
                 if (errno == EINTR) continue;
@@ -121,44 +1115,20 @@ namespace StardustLib
                 continue;
             }
         
-            if (pfd.revents & POLLIN)
+            for (size_t i = 0; i < pfds.size(); ++i)
             {
-                uint32_t outIPAddress = 0;
-                std::unique_ptr<Socket> newSock;
-                auto ares = listenSocket->accept(newSock, outIPAddress);
-            
-                WHBLogPrintf("[accept] result=%d newFd=%d ip=0x%08x", (int)ares, newSock ? newSock->getFd() : -1, outIPAddress);
-            
-                if (ares == Socket::Result::Success)
-                {
-                    if (!newSock || newSock->getFd() < 0)
-                    {
-                        WHBLogPrintf("[accept] accepted invalid socket, ignoring");
-                    }
-                    else
-                    {
-                        auto client = std::make_unique<Client>();
-                        client->id = clientCounter++;
-                        client->socket = std::move(newSock);
-                        {
-                            std::lock_guard<std::mutex> lk(clientsMtx);
-                            clients.push_back(std::move(client));
-                            WHBLogPrintf("[accept] pushed clients.size=%d", (int)clients.size());
-                        }
-                        if (clientIPAddressCallback) clientIPAddressCallback(outIPAddress, clientCounter - 1);
-                    }
-                }
-                else if (ares == Socket::Result::WouldBlock)
+                if (!(pfds[i].revents & POLLIN)) continue;
+
+                // バックログが空になるまでまとめて受け付ける
+                auto ares = Socket::Result::Success;
+                while (ares == Socket::Result::Success && !token.stop_requested())
                 {
-                    // poll が偽陽性のときなど。短いスリープで busy-wait を防ぐ
-                    std::this_thread::sleep_for(std::chrono::milliseconds(2));
-                    continue;
+                    ares = acceptClient(*listeners[i], listeners[i] == unixListenSocket.get());
                 }
-                else
+                if (ares != Socket::Result::Success && ares != Socket::Result::WouldBlock)
                 {
                     WHBLogPrintf("[accept] error ares=%d errno=%d", (int)ares, errno);
                     std::this_thread::sleep_for(std::chrono::milliseconds(20));
-                    continue;
                 }
             }
         }
@@ -168,11 +1138,15 @@ namespace StardustLib
     
     void TCPServer::runTransferLoop(std::stop_token token, int timeoutMs)
     {
-        struct Snap { Client* client; int fd; bool wantWrite; };
+        struct Snap { Client* client; int fd; bool wantWrite; int eventIndex; };
+
+        std::vector<uint8_t> buf(0x1000);
     
         while (!token.stop_requested())
         {
             std::vector<Snap> snaps;
+
+            adoptPendingClients();
         
             // 1) clients のスナップショットを作る（ロック下）
             {
@@ -183,36 +1157,70 @@ namespace StardustLib
                     if (!up || !up->socket) continue;
                     int fd = up->socket->getFd();
                     if (fd < 0) continue;
-                    bool wantWrite = false;
-                    {
-                        std::lock_guard<std::mutex> sendlk(up->sendMutex);
-                        if (!up->sendQueue.empty()) wantWrite = true;
-                    }
-                    snaps.push_back({ up.get(), fd, wantWrite });
+                    bool wantWrite = hasPendingSend(*up);
+                    snaps.push_back({ up.get(), fd, wantWrite, -1 });
                     WHBLogPrintf("[snapshot] id=%llu fd=%d wantWrite=%d",
                                  (unsigned long long)up->id, fd, (int)wantWrite);
                 }
             }
         
-            if (snaps.empty())
-            {
-                std::this_thread::sleep_for(std::chrono::milliseconds(10));
-                continue;
-            }
-        
-            // 2) pollfd 配列を作る（listen なし、clients のみ）
+            // 2) pollfd 配列を作る（listen なし、clients と起床用 eventfd と UDP ソケット）
             std::vector<pollfd> pfds;
-            pfds.reserve(snaps.size());
+            pfds.reserve(snaps.size() + 1);
+            bool sharedReady = false;
             for (auto &s : snaps)
             {
                 pollfd pfd{};
                 pfd.fd = s.fd;
-                pfd.events = POLLIN | (s.wantWrite ? POLLOUT : 0);
+                pfd.events = POLLIN | (s.wantWrite && !s.client->shared ? POLLOUT : 0);
+                pfd.revents = 0;
+                pfds.push_back(pfd);
+            }
+            // 共有メモリの接続は eventfd で待つ（リングに何かあれば poll で止まらない）
+            // クライアントが切り替えるまではリングを読まないので待たない
+            for (auto &s : snaps)
+            {
+                if (!s.client->shared || !s.client->sharedAttached) continue;
+                if (!s.client->shared->prepareWait(s.wantWrite)) sharedReady = true;
+
+                pollfd pfd{};
+                pfd.fd = s.client->shared->getWaitFd();
+                pfd.events = POLLIN;
+                pfd.revents = 0;
+                s.eventIndex = (int)pfds.size();
+                pfds.push_back(pfd);
+            }
+            int wakeIndex = -1;
+            if (transferWakeFd >= 0)
+            {
+                pollfd pfd{};
+                pfd.fd = transferWakeFd;
+                pfd.events = POLLIN;
+                pfd.revents = 0;
+                wakeIndex = (int)pfds.size();
+                pfds.push_back(pfd);
+            }
+            if (datagramSocket)
+            {
+                pollfd pfd{};
+                pfd.fd = datagramSocket->getFd();
+                pfd.events = POLLIN;
                 pfd.revents = 0;
                 pfds.push_back(pfd);
             }
         
-            int pret = poll(pfds.data(), pfds.size(), timeoutMs);
+            // 次のタイマーまでしか寝ない。スピン中は寝ずにすぐ見に行く
+            int waitMs = sharedReady || transferSpin.shouldSpin() ? 0 : timerTimeout(timeoutMs);
+            int pret = 0;
+            if (pfds.empty())
+            {
+                // 起こす手段がないので、新しい接続を待たせすぎないように短く刻む
+                std::this_thread::sleep_for(std::chrono::milliseconds(std::min(waitMs, 10)));
+            }
+            else
+            {
+                pret = poll(pfds.data(), pfds.size(), waitMs);
+            }
             if (pret < 0)
             {
                 if (errno == EINTR) continue;
@@ -223,36 +1231,53 @@ namespace StardustLib
                 WHBLogPrintf("[transfer] poll fatal errno=%d", errno);
                 break;
             }
-            if (pret == 0) continue;
+            if (pret > 0 || sharedReady) transferSpin.onWork();
+            if (wakeIndex >= 0 && (pfds[wakeIndex].revents & POLLIN))
+            {
+                uint64_t count;
+                ssize_t ret = ::read(transferWakeFd, &count, sizeof(count));
+                (void)ret;
+            }
+
+            runTimers();
         
             // 3) スナップショットに対応して安全に処理（pfds[i] <-> snaps[i]）
-            for (size_t i = 0; i < pfds.size(); ++i)
+            if (datagramSocket)
+            {
+                if (pfds.back().revents & POLLIN) receiveDatagrams();
+                flushDatagrams();
+            }
+
+            for (size_t i = 0; i < snaps.size(); ++i)
             {
                 auto &pfd = pfds[i];
                 auto &snap = snaps[i];
                 Client* client = snap.client;
                 if (!client) continue; // safety
+
+                if (client->expired)
+                {
+                    if (disconnectCallback) disconnectCallback(client->id);
+                    client->socket->close();
+                    continue;
+                }
             
                 WHBLogPrintf("[transfer] handling id=%llu fd=%d revents=0x%x",
                              (unsigned long long)client->id, pfd.fd, pfd.revents);
                 
-                // recv
+                // recv（ソケットが先。切り替えの SharedMemory はソケットで届く）
                 if (pfd.revents & POLLIN)
                 {
-                    std::vector<uint8_t> buf(0x1000);
                     ssize_t recvd = 0;
                     auto rres = client->socket->recv(buf.data(), buf.size(), recvd);
                     WHBLogPrintf("[transfer] recv id=%llu rres=%d recvd=%d", (unsigned long long)client->id, (int)rres, (int)recvd);
                 
                     if (rres == Socket::Result::Success && recvd > 0)
                     {
-                        Packet pkt;
-                        pkt.clientId = client->id;
-                        pkt.data.insert(pkt.data.end(), buf.begin(), buf.begin() + recvd);
+                        if (!onReceived(*client, buf.data(), recvd, false))
                         {
-                            std::lock_guard<std::mutex> qlk(queueMtx);
-                            packetQueue.push(pkt);
-                            queueCv.notify_one();
+                            if (disconnectCallback) disconnectCallback(client->id);
+                            client->socket->close();
                         }
                     }
                     else if (rres == Socket::Result::Closed || rres == Socket::Result::Error)
@@ -262,30 +1287,27 @@ namespace StardustLib
                         client->socket->close();
                     }
                 }
+
+                if (client->shared && client->sharedAttached && client->socket->getFd() >= 0)
+                {
+                    if (snap.eventIndex >= 0 && (pfds[snap.eventIndex].revents & POLLIN)) client->shared->consumeWakeup();
+                    bool ok = receiveShared(*client, buf) && flushSend(*client);
+                    if (!ok)
+                    {
+                        if (disconnectCallback) disconnectCallback(client->id);
+                        client->socket->close();
+                        continue;
+                    }
+                }
             
                 // send
                 if (pfd.revents & POLLOUT)
                 {
-                    std::lock_guard<std::mutex> sendlk(client->sendMutex);
-                    if (!client->sendQueue.empty())
+                    if (!flushSend(*client))
                     {
-                        ssize_t sent = 0;
-                        auto &front = client->sendQueue.front();
-                        auto sres = client->socket->send(front.data(), front.size(), sent);
-                        WHBLogPrintf("[transfer] send id=%llu sres=%d sent=%d front=%d",
-                                     (unsigned long long)client->id, (int)sres, (int)sent, (int)front.size());
-                        
-                        if (sres == Socket::Result::Success || sres == Socket::Result::WouldBlock)
-                        {
-                            if ((size_t)sent == front.size()) client->sendQueue.pop_front();
-                            else if (sent > 0) front.erase(front.begin(), front.begin() + sent);
-                        }
-                        else
-                        {
-                            WHBLogPrintf("[transfer] send closed id=%llu", (unsigned long long)client->id);
-                            if (disconnectCallback) disconnectCallback(client->id);
-                            client->socket->close();
-                        }
+                        WHBLogPrintf("[transfer] send closed id=%llu", (unsigned long long)client->id);
+                        if (disconnectCallback) disconnectCallback(client->id);
+                        client->socket->close();
                     }
                 }
             } // for pfds/snaps
@@ -299,6 +1321,7 @@ namespace StardustLib
                     {
                         WHBLogPrintf("[transfer] cleanup erase id=%llu", (*it) ? (unsigned long long)(*it)->id : (unsigned long long)-1);
                         if (*it && (*it)->socket) (*it)->socket->close();
+                        if (*it) unwatchIdle(**it);
                         it = clients.erase(it);
                     }
                     else ++it;
@@ -307,26 +1330,286 @@ namespace StardustLib
         } // while
     }
     
+    void TCPServer::runUringLoop(std::stop_token token, int timeoutMs)
+    {
+        // 完了が返るまで Client を消さないように、投入中の操作数を数えておく
+        // 投入キューが埋まって積めなかったものは *Pending を立てて、次の周回でやり直す
+        struct State
+        {
+            Client* client;
+            int inFlight = 0;
+            bool sending = false;
+            bool closing = false;
+            bool recvPending = false;
+            bool sharedPending = false;
+            bool sendPending = false;
+            bool cancelPending = false;
+        };
+        // listen ソケットなど接続に属さない multishot の積み直し
+        struct Rearm { bool accept; int fd; uint64_t userData; };
+
+        IoUring& ring = *uring;
+        std::unordered_map<uint32_t, State> states;
+        std::vector<IoUring::Completion> completions;
+        std::vector<Rearm> rearms;
+        std::vector<uint8_t> buf(0x1000);
+
+        auto armRecv = [&](State& state)
+        {
+            state.recvPending = !ring.prepareRecvMultishot(state.client->socket->getFd(), uringData(UringOp::Recv, state.client->id));
+            if (!state.recvPending) state.inFlight++;
+        };
+        auto armShared = [&](State& state)
+        {
+            state.sharedPending = !ring.preparePollMultishot(state.client->shared->getWaitFd(), uringData(UringOp::SharedEvent, state.client->id));
+            if (!state.sharedPending) state.inFlight++;
+        };
+        auto armGlobal = [&](bool accept, int fd, uint64_t userData)
+        {
+            bool queued = accept ? ring.prepareAcceptMultishot(fd, userData) : ring.preparePollMultishot(fd, userData);
+            if (!queued) rearms.push_back({ accept, fd, userData });
+        };
+        auto cancel = [&](State& state)
+        {
+            // 片方だけ積めた場合も両方やり直す（該当なしの取り消しは -ENOENT で返るだけ）
+            bool queued = ring.prepareCancelFd(state.client->socket->getFd(), uringData(UringOp::Cancel, state.client->id));
+            if (queued && state.client->shared) queued = ring.prepareCancelFd(state.client->shared->getWaitFd(), uringData(UringOp::Cancel, state.client->id));
+            state.cancelPending = !queued;
+        };
+        auto disconnect = [&](State& state)
+        {
+            if (state.closing) return;
+            state.closing = true;
+            WHBLogPrintf("[uring] disconnect id=%llu", (unsigned long long)state.client->id);
+            if (disconnectCallback) disconnectCallback(state.client->id);
+            cancel(state);
+        };
+        auto startSend = [&](State& state)
+        {
+            Client& client = *state.client;
+            std::lock_guard<std::mutex> sendlk(client.sendMutex);
+            if (client.sendingOffset >= client.sending.size())
+            {
+                client.sending.clear();
+                client.sendingOffset = 0;
+                if (!selectNextChunk(client)) return;
+            }
+
+            // 送り終わるまで sending は transfer スレッド以外から触られない
+            // 積めなければ sending を立てずに戻り、次の周回で同じチャンクからやり直す
+            state.sendPending = !ring.prepareSend(client.socket->getFd(), client.sending.data() + client.sendingOffset, client.sending.size() - client.sendingOffset, uringData(UringOp::Send, client.id));
+            if (state.sendPending) return;
+            state.sending = true;
+            state.inFlight++;
+        };
+
+        for (size_t i = 0; i < listenSockets.size(); ++i) armGlobal(true, listenSockets[i]->getFd(), uringData(UringOp::Accept, (uint32_t)i));
+        if (unixListenSocket) armGlobal(true, unixListenSocket->getFd(), uringData(UringOp::UnixAccept));
+        armGlobal(false, ring.getWakeFd(), uringData(UringOp::Wake));
+        if (datagramSocket) armGlobal(false, datagramSocket->getFd(), uringData(UringOp::Datagram));
+
+        bool sharedReady = false;
+        bool retryPending = false;
+        while (!token.stop_requested())
+        {
+            // 1) 溜まった SQE を 1 回のシステムコールで投入して完了を待つ
+            // スピン中は完了キューを見るだけで、投入するものがなければシステムコールもしない
+            // 積み残しがあるときは、投入で空いた分にすぐ積み直せるように待たない
+            bool spinning = !sharedReady && !retryPending && transferSpin.shouldSpin();
+            if (ring.submitAndWait(sharedReady || retryPending || spinning ? 0 : timerTimeout(timeoutMs)) < 0)
+            {
+                WHBLogPrintf("[uring] enter error errno=%d", errno);
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+
+            completions.clear();
+            ring.reap(completions);
+            if (!completions.empty() || sharedReady) transferSpin.onWork();
+            else if (spinning) AdaptiveSpin::relax();
+
+            if (!rearms.empty())
+            {
+                std::vector<Rearm> retry;
+                retry.swap(rearms);
+                for (const auto& rearm : retry) armGlobal(rearm.accept, rearm.fd, rearm.userData);
+            }
+
+            // 2) 完了を処理する
+            for (const auto& completion : completions)
+            {
+                UringOp op = (UringOp)(completion.userData >> 32);
+                uint32_t id = (uint32_t)completion.userData;
+                bool more = IoUring::hasMore(completion.flags);
+
+                if (op == UringOp::Accept || op == UringOp::UnixAccept)
+                {
+                    Socket& listener = op == UringOp::Accept ? *listenSockets[id] : *unixListenSocket;
+                    if (completion.result >= 0)
+                    {
+                        auto socket = std::make_unique<Socket>();
+                        uint32_t ipAddress = 0;
+                        socket->adopt(completion.result, ipAddress);
+                        Client* client = addClient(makeClient(std::move(socket), ipAddress, op == UringOp::UnixAccept));
+
+                        State& state = states[client->id];
+                        state.client = client;
+                        armRecv(state);
+                        if (client->shared) armShared(state);
+                        watchIdle(*client);
+                    }
+                    else
+                    {
+                        WHBLogPrintf("[uring] accept error res=%d", completion.result);
+                    }
+                    if (!more) armGlobal(true, listener.getFd(), completion.userData);
+                    continue;
+                }
+                if (op == UringOp::Wake)
+                {
+                    ring.consumeWake();
+                    if (!more) armGlobal(false, ring.getWakeFd(), completion.userData);
+                    continue;
+                }
+                if (op == UringOp::Datagram)
+                {
+                    receiveDatagrams();
+                    if (!more) armGlobal(false, datagramSocket->getFd(), completion.userData);
+                    continue;
+                }
+                if (op == UringOp::Cancel) continue;
+
+                auto it = states.find(id);
+                if (it == states.end())
+                {
+                    if (IoUring::hasBuffer(completion.flags)) ring.recycleBuffer(completion.flags);
+                    continue;
+                }
+                State& state = it->second;
+                if (!more) state.inFlight--;
+
+                if (op == UringOp::Recv)
+                {
+                    if (completion.result > 0 && IoUring::hasBuffer(completion.flags))
+                    {
+                        // 提供バッファから直接フレームを組み立てる（コピーは recvBuffer への追記のみ）
+                        bool ok = state.closing || onReceived(*state.client, ring.buffer(completion.flags, completion.result).data(), completion.result, false);
+                        ring.recycleBuffer(completion.flags);
+                        if (!ok) disconnect(state);
+                        else if (!more && !state.closing) armRecv(state);
+                    }
+                    else if (completion.result == -ENOBUFS)
+                    {
+                        // 提供バッファを使い切った。返却済みなのでもう一度待つ
+                        if (!more && !state.closing) armRecv(state);
+                    }
+                    else if (!more)
+                    {
+                        WHBLogPrintf("[uring] recv closed id=%llu res=%d", (unsigned long long)id, completion.result);
+                        disconnect(state);
+                    }
+                }
+                else if (op == UringOp::Send)
+                {
+                    state.sending = false;
+                    if (completion.result > 0)
+                    {
+                        std::lock_guard<std::mutex> sendlk(state.client->sendMutex);
+                        state.client->sendingOffset += completion.result;
+                    }
+                    else if (completion.result != -EAGAIN && completion.result != -EINTR)
+                    {
+                        WHBLogPrintf("[uring] send closed id=%llu res=%d", (unsigned long long)id, completion.result);
+                        disconnect(state);
+                    }
+                }
+                else if (op == UringOp::SharedEvent)
+                {
+                    if (!state.closing) state.client->shared->consumeWakeup();
+                    if (!more && !state.closing) armShared(state);
+                }
+            }
+
+            if (datagramSocket) flushDatagrams();
+            runTimers();
+
+            // 3) 送信を詰める。共有メモリの接続はここで直接読み書きする
+            sharedReady = false;
+            retryPending = !rearms.empty();
+            for (auto it = states.begin(); it != states.end(); )
+            {
+                State& state = it->second;
+                Client& client = *state.client;
+
+                if (client.expired) disconnect(state);
+                if (!state.closing && state.recvPending) armRecv(state);
+                if (!state.closing && state.sharedPending) armShared(state);
+                if (state.closing && state.cancelPending && state.inFlight > 0) cancel(state);
+                if (!state.closing && client.shared)
+                {
+                    // 切り替えの SharedMemory が届くまではリングに触らない（送信も待たせる）
+                    if (client.sharedAttached)
+                    {
+                        if (!receiveShared(client, buf) || !flushSend(client)) disconnect(state);
+                        else if (!client.shared->prepareWait(hasPendingSend(client))) sharedReady = true;
+                    }
+                }
+                else if (!state.closing && !state.sending)
+                {
+                    startSend(state);
+                }
+                if (state.closing ? state.cancelPending : (state.recvPending || state.sharedPending || state.sendPending)) retryPending = true;
+
+                // 4) 取り消しが全部返ってきたら片付ける
+                if (state.closing && state.inFlight == 0)
+                {
+                    WHBLogPrintf("[uring] cleanup erase id=%llu", (unsigned long long)client.id);
+                    client.socket->close();
+                    unwatchIdle(client);
+                    {
+                        std::lock_guard<std::mutex> lk(clientsMtx);
+                        std::erase_if(clients, [&](const auto& c) { return c.get() == &client; });
+                    }
+                    it = states.erase(it);
+                }
+                else ++it;
+            }
+        }
+
+        WHBLogPrintf("[uring] loop exit");
+    }
+    
     void TCPServer::runProcessLoop(std::stop_token token)
     {
+        std::vector<Packet> packets;
+        std::vector<std::function<void()>> tasks;
+
         while(!token.stop_requested())
         {
-            Packet packet;
+            // ロックを取らずにフラグだけ見て回り、受け渡しでのコンテキストスイッチを避ける
+            while(!queueReady.load(std::memory_order_acquire) && !token.stop_requested() && processSpin.shouldSpin()) AdaptiveSpin::relax();
+
             {
                 std::unique_lock<std::mutex> lock(queueMtx);
                 queueCv.wait(lock, [this, &token]
                 {
-                    return !packetQueue.empty() || token.stop_requested();
+                    return !packetQueue.empty() || !taskQueue.empty() || token.stop_requested();
                 });
             
                 if(token.stop_requested()) break;
-                if(packetQueue.empty()) continue;
             
-                packet = packetQueue.front();
-                packetQueue.pop();
+                // 溜まっている分をまとめて取り出す（容量は交互に再利用される）
+                packets.clear();
+                packets.swap(packetQueue);
+                tasks.clear();
+                tasks.swap(taskQueue);
+                queueReady.store(false, std::memory_order_relaxed);
             }
+            processSpin.onWork();
+
+            for(auto& task : tasks) task();
+            if(packets.empty()) continue;
         
-            if(recvCallback) recvCallback(packet);
+            deliverPackets(packets);
         }
     }
 }
\ No newline at end of file
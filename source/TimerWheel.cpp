@@ -0,0 +1,169 @@
+#include "StardustLib/TimerWheel.hpp"
+
+#include <algorithm>
+#include <bit>
+
+namespace StardustLib
+{
+    TimerWheel::TimerWheel(uint64_t now) : current(now)
+    {
+        buckets.fill(Invalid);
+    }
+
+    void TimerWheel::link(uint32_t index)
+    {
+        Node& node = nodes[index];
+
+        // 期限までの距離で段を決める。範囲外は最上段の一番遠いスロットで待たせる
+        uint64_t delta = std::min(node.expiry - current, MaxDelay);
+        uint64_t target = current + delta;
+        size_t level = 0;
+        while(level + 1 < LevelCount && delta >= ((uint64_t)1 << (SlotBits * (level + 1)))) level++;
+
+        size_t slot = (target >> (SlotBits * level)) & (SlotCount - 1);
+        node.bucket = (uint16_t)(level * SlotCount + slot);
+        node.prev = Invalid;
+        node.next = buckets[node.bucket];
+        if(node.next != Invalid) nodes[node.next].prev = index;
+        buckets[node.bucket] = index;
+        occupied[level] |= (uint64_t)1 << slot;
+    }
+
+    void TimerWheel::unlink(uint32_t index)
+    {
+        Node& node = nodes[index];
+        if(node.prev != Invalid) nodes[node.prev].next = node.next;
+        else buckets[node.bucket] = node.next;
+        if(node.next != Invalid) nodes[node.next].prev = node.prev;
+
+        if(buckets[node.bucket] == Invalid)
+        {
+            occupied[node.bucket / SlotCount] &= ~((uint64_t)1 << (node.bucket % SlotCount));
+        }
+    }
+
+    void TimerWheel::cascade(size_t level)
+    {
+        size_t slot = (current >> (SlotBits * level)) & (SlotCount - 1);
+        uint32_t index = buckets[level * SlotCount + slot];
+        buckets[level * SlotCount + slot] = Invalid;
+        occupied[level] &= ~((uint64_t)1 << slot);
+
+        while(index != Invalid)
+        {
+            uint32_t next = nodes[index].next;
+            link(index);
+            index = next;
+        }
+    }
+
+    TimerWheel::TimerId TimerWheel::schedule(uint64_t delay, Callback callback)
+    {
+        uint32_t index;
+        if(!freeNodes.empty())
+        {
+            index = freeNodes.back();
+            freeNodes.pop_back();
+        }
+        else
+        {
+            index = (uint32_t)nodes.size();
+            nodes.emplace_back();
+        }
+
+        Node& node = nodes[index];
+        node.callback = std::move(callback);
+        node.expiry = current + std::max<uint64_t>(delay, 1);
+        node.active = true;
+        link(index);
+        count++;
+
+        return ((uint64_t)node.generation << 32) | index;
+    }
+
+    bool TimerWheel::cancel(TimerId id)
+    {
+        uint32_t index = (uint32_t)id;
+        if(id == 0 || index >= nodes.size()) return false;
+
+        Node& node = nodes[index];
+        if(!node.active || node.generation != (uint32_t)(id >> 32)) return false;
+
+        unlink(index);
+        node.callback = nullptr;
+        node.active = false;
+        node.generation++;
+        freeNodes.push_back(index);
+        count--;
+        return true;
+    }
+
+    void TimerWheel::advance(uint64_t now, std::vector<Callback>& out)
+    {
+        if(count == 0)
+        {
+            current = std::max(current, now);
+            return;
+        }
+
+        while(current < now)
+        {
+            current++;
+
+            // 下の段が一周したら上の段のスロットを下ろす（上から順に）
+            size_t levels = 1;
+            while(levels < LevelCount && ((current >> (SlotBits * levels - SlotBits)) & (SlotCount - 1)) == 0) levels++;
+            for(size_t level = levels - 1; level >= 1; level--) cascade(level);
+
+            size_t slot = current & (SlotCount - 1);
+            uint32_t index = buckets[slot];
+            while(index != Invalid)
+            {
+                Node& node = nodes[index];
+                uint32_t next = node.next;
+                if(node.expiry <= current)
+                {
+                    unlink(index);
+                    out.push_back(std::move(node.callback));
+                    node.callback = nullptr;
+                    node.active = false;
+                    node.generation++;
+                    freeNodes.push_back(index);
+                    count--;
+                }
+                else
+                {
+                    // MaxDelay を超えていたもの。残りの距離で入れ直す
+                    unlink(index);
+                    link(index);
+                }
+                index = next;
+            }
+
+            if(count == 0)
+            {
+                current = now;
+                break;
+            }
+        }
+    }
+
+    uint64_t TimerWheel::ticksUntilNext() const
+    {
+        uint64_t best = UINT64_MAX;
+        for(size_t level = 0; level < LevelCount; level++)
+        {
+            if(occupied[level] == 0) continue;
+
+            // 現在のスロットの次から一周ぶん探す。上の段はそのスロットが下ろされる時刻
+            size_t shift = SlotBits * level;
+            size_t slot = (current >> shift) & (SlotCount - 1);
+            uint64_t rotated = std::rotr(occupied[level], (int)((slot + 1) & (SlotCount - 1)));
+            uint64_t distance = (uint64_t)std::countr_zero(rotated) + 1;
+
+            uint64_t at = (((current >> shift) + distance) << shift);
+            best = std::min(best, at - current);
+        }
+        return best;
+    }
+}